@@ -0,0 +1,143 @@
+// bench_render.cpp: timing of the render backend on synthetic scenes
+// usage: bench_render [repeats [maxFaces [maxWidth]]]
+// prints a tab-separated table with one row per (resolution, mesh size, operation), all times in milliseconds
+
+#include "recon.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <algorithm>
+
+#ifndef BENCH_BACKEND
+	#define BENCH_BACKEND "unknown"
+#endif
+
+const int resolutions[][2] = {{640, 480}, {1280, 720}, {1920, 1080}, {3840, 2160}};
+const int faceCounts[] = {1000, 10000, 100000, 1000000, 5000000};
+const float fieldOfView = 60 * M_PI / 180;
+const float cameraDistance = 3;
+
+// Regular grid over [-1, 1]^2 with a wavy height, having at least the given number of triangles
+Mesh syntheticMesh(int faceCount)
+{
+	int size = ceil(sqrt(faceCount / 2.));
+	Mat vertices(pow(size+1, 2), 4, CV_32FC1), faces(2*size*size, 3, CV_32SC1);
+	for (int i=0; i <= size; i++) {
+		for (int j=0; j <= size; j++) {
+			float *vertex = vertices.ptr<float>(i*(size+1) + j);
+			vertex[0] = 2. * j / size - 1;
+			vertex[1] = 2. * i / size - 1;
+			vertex[2] = 0.1 * sin(10 * vertex[0]) * cos(10 * vertex[1]);
+			vertex[3] = 1;
+		}
+	}
+	for (int i=0; i < size; i++) {
+		for (int j=0; j < size; j++) {
+			int corner = i*(size+1) + j;
+			int32_t *face = faces.ptr<int32_t>(2*(i*size + j));
+			face[0] = corner; face[1] = corner + 1; face[2] = corner + size + 1;
+			face[3] = corner + 1; face[4] = corner + size + 2; face[5] = corner + size + 1;
+		}
+	}
+	return Mesh(vertices, faces);
+}
+
+// Perspective camera looking at the origin from the given angle around the vertical axis
+Mat orbitCamera(float angle, float aspect)
+{
+	cv::Vec3f eye(cameraDistance * sin(angle), 0.5, cameraDistance * cos(angle)),
+	          forward = cv::normalize(-eye),
+	          right = cv::normalize(forward.cross(cv::Vec3f(0, 1, 0))),
+	          up = right.cross(forward);
+	cv::Matx44f view(right[0], right[1], right[2], -right.dot(eye),
+	                 up[0], up[1], up[2], -up.dot(eye),
+	                 -forward[0], -forward[1], -forward[2], forward.dot(eye),
+	                 0, 0, 0, 1);
+	float near = 0.1, far = 100, f = 1 / tan(fieldOfView / 2);
+	cv::Matx44f projection(f / aspect, 0, 0, 0,
+	                       0, f, 0, 0,
+	                       0, 0, (far + near) / (near - far), 2 * far * near / (near - far),
+	                       0, 0, -1, 0);
+	return Mat(projection * view);
+}
+
+// Print a table row with statistics of the given durations
+void report(int width, int height, int faceCount, const char *operation, std::vector<double> times)
+{
+	std::sort(times.begin(), times.end());
+	double sum = 0;
+	for (int i=0; i < times.size(); i++)
+		sum += times[i];
+	int last = times.size() - 1;
+	printf("%s\t%i\t%i\t%i\t%s\t%i\t%.3f\t%.3f\t%.3f\t%.3f\t%.3f\n", BENCH_BACKEND, width, height, faceCount, operation, (int)times.size(),
+		times[0], times[(int)(0.5*last + 0.5)], times[(int)(0.9*last + 0.5)], times[(int)(0.99*last + 0.5)], sum / times.size());
+	fflush(stdout);
+}
+
+double milliseconds(int64 start)
+{
+	return 1000. * (cv::getTickCount() - start) / cv::getTickFrequency();
+}
+
+int main(int argc, char **argv)
+{
+	int repeats = (argc > 1) ? atoi(argv[1]) : 10;
+	int maxFaces = (argc > 2) ? atoi(argv[2]) : faceCounts[sizeof(faceCounts)/sizeof(*faceCounts) - 1];
+	int maxWidth = (argc > 3) ? atoi(argv[3]) : resolutions[sizeof(resolutions)/sizeof(*resolutions) - 1][0];
+	repeats = IMAX(repeats, 1);
+
+	printf("backend\twidth\theight\tfaces\toperation\trepeats\tmin\tp50\tp90\tp99\tmean\n");
+	for (int r=0; r < sizeof(resolutions)/sizeof(*resolutions); r++) {
+		int width = resolutions[r][0], height = resolutions[r][1];
+		if (width > maxWidth)
+			continue;
+		float aspect = float(width) / height;
+		Mat frame(height, width, CV_8UC1);
+		cv::randu(frame, 0, 256);
+		Mat camera = orbitCamera(0, aspect);
+
+		for (int m=0; m < sizeof(faceCounts)/sizeof(*faceCounts); m++) {
+			if (faceCounts[m] > maxFaces)
+				continue;
+			Mesh mesh = syntheticMesh(faceCounts[m]);
+			std::vector<double> freshTimes, reuseTimes, depthTimes, projectedTimes;
+			// a new instance for each upload, so that the mesh buffers have to be allocated
+			// (only one instance exists at a time, as each of them makes its own context current)
+			for (int i=0; i < repeats; i++) {
+				Render *fresh = spawnRender(cv::Size(width, height));
+				int64 start = cv::getTickCount();
+				fresh->loadMesh(mesh);
+				freshTimes.push_back(milliseconds(start));
+				delete fresh;
+			}
+
+			Render *render = spawnRender(cv::Size(width, height));
+			render->loadFrames(std::vector<Mat>(1, frame));
+			// the first upload allocates the buffers, the timed ones reuse them
+			render->loadMesh(mesh);
+			for (int i=0; i < repeats; i++) {
+				int64 start = cv::getTickCount();
+				render->loadMesh(mesh);
+				reuseTimes.push_back(milliseconds(start));
+			}
+			for (int i=0; i < repeats; i++) {
+				int64 start = cv::getTickCount();
+				render->depth(camera);
+				depthTimes.push_back(milliseconds(start));
+			}
+			for (int i=0; i < repeats; i++) {
+				// a different projector each time, so that no shadow map is cached
+				Mat projector = orbitCamera(0.3 + 0.01*i, aspect);
+				int64 start = cv::getTickCount();
+				render->projected(camera, 0, projector);
+				projectedTimes.push_back(milliseconds(start));
+			}
+			delete render;
+			report(width, height, mesh.faces.rows, "loadMeshFresh", freshTimes);
+			report(width, height, mesh.faces.rows, "loadMeshReuse", reuseTimes);
+			report(width, height, mesh.faces.rows, "depth", depthTimes);
+			report(width, height, mesh.faces.rows, "projected", projectedTimes);
+		}
+	}
+	return 0;
+}
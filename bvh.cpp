@@ -0,0 +1,179 @@
+// bvh.cpp: bounding volume hierarchy over mesh faces, for visibility queries on the CPU
+
+#include "recon.hpp"
+#include <algorithm>
+#include <cfloat>
+
+// maximal number of faces in a leaf node
+const int leafSize = 4;
+// maximal depth of the tree, so that the traversal stack cannot overflow
+const int maxDepth = 64;
+
+inline float dot3(const float *a, const float *b)
+{
+	return a[0]*b[0] + a[1]*b[1] + a[2]*b[2];
+}
+
+inline void cross3(const float *a, const float *b, float *out)
+{
+	out[0] = a[1]*b[2] - a[2]*b[1];
+	out[1] = a[2]*b[0] - a[0]*b[2];
+	out[2] = a[0]*b[1] - a[1]*b[0];
+}
+
+// orders face indices by the position of their centroid along a given axis
+class CentroidLess {
+	public:
+		CentroidLess(const std::vector<cv::Vec3f> &centroids, int axis): centroids(centroids), axis(axis) {};
+		bool operator()(int a, int b) const { return centroids[a][axis] < centroids[b][axis]; }
+	protected:
+		const std::vector<cv::Vec3f> &centroids;
+		int axis;
+};
+
+MeshBVH::MeshBVH(const Mesh mesh)
+{
+	int faceCount = mesh.faces.rows;
+	Mat points = dehomogenize(mesh.vertices);
+
+	// store each face as a vertex and two edges, as needed by the intersection test
+	std::vector<Triangle> faces(faceCount);
+	std::vector<cv::Vec3f> centroids(faceCount);
+	for (int i=0; i < faceCount; i++) {
+		const int32_t *vertIdx = mesh.faces.ptr<int32_t>(i);
+		const float *a = points.ptr<float>(vertIdx[0]),
+		            *b = points.ptr<float>(vertIdx[1]),
+		            *c = points.ptr<float>(vertIdx[2]);
+		for (int j=0; j<3; j++) {
+			faces[i].vertex[j] = a[j];
+			faces[i].edgeB[j] = b[j] - a[j];
+			faces[i].edgeC[j] = c[j] - a[j];
+			centroids[i][j] = (a[j] + b[j] + c[j]) / 3;
+		}
+	}
+
+	std::vector<int> order(faceCount);
+	for (int i=0; i < faceCount; i++)
+		order[i] = i;
+	nodes.reserve(2 * faceCount / leafSize + 1);
+	if (faceCount > 0)
+		build(faces, centroids, order, 0, faceCount, 0);
+
+	// store the faces in the order of leaves, so that each leaf refers to a contiguous range
+	triangles.resize(faceCount);
+	for (int i=0; i < faceCount; i++)
+		triangles[i] = faces[order[i]];
+}
+
+// recursively build the subtree containing faces order[begin, ..., end-1]
+// returns index of the newly created node; its left child (if any) immediately follows it
+int MeshBVH::build(const std::vector<Triangle> &faces, const std::vector<cv::Vec3f> &centroids, std::vector<int> &order, int begin, int end, int depth)
+{
+	int index = nodes.size();
+	nodes.push_back(Node());
+	Node node;
+	for (int j=0; j<3; j++) {
+		node.lower[j] = FLT_MAX;
+		node.upper[j] = -FLT_MAX;
+	}
+	// bounding box of all the faces, and of their centroids (to choose the splitting axis)
+	float centroidLower[3] = {FLT_MAX, FLT_MAX, FLT_MAX}, centroidUpper[3] = {-FLT_MAX, -FLT_MAX, -FLT_MAX};
+	for (int i=begin; i < end; i++) {
+		const Triangle &face = faces[order[i]];
+		for (int j=0; j<3; j++) {
+			float a = face.vertex[j], b = a + face.edgeB[j], c = a + face.edgeC[j];
+			node.lower[j] = IMIN(node.lower[j], IMIN(a, IMIN(b, c)));
+			node.upper[j] = IMAX(node.upper[j], IMAX(a, IMAX(b, c)));
+			centroidLower[j] = IMIN(centroidLower[j], centroids[order[i]][j]);
+			centroidUpper[j] = IMAX(centroidUpper[j], centroids[order[i]][j]);
+		}
+	}
+
+	int axis = 0;
+	for (int j=1; j<3; j++) {
+		if (centroidUpper[j] - centroidLower[j] > centroidUpper[axis] - centroidLower[axis])
+			axis = j;
+	}
+	if (end - begin <= leafSize || depth >= maxDepth-1 || centroidUpper[axis] == centroidLower[axis]) {
+		// make a leaf
+		node.offset = begin;
+		node.count = end - begin;
+	} else {
+		// split at the median along the longest axis
+		int middle = (begin + end) / 2;
+		std::nth_element(order.begin() + begin, order.begin() + middle, order.begin() + end, CentroidLess(centroids, axis));
+		build(faces, centroids, order, begin, middle, depth+1);
+		node.offset = build(faces, centroids, order, middle, end, depth+1);
+		node.count = 0;
+	}
+	nodes[index] = node;
+	return index;
+}
+
+// check if the segment between two points hits any face
+// epsilon: length at both ends of the segment that is not checked, so that a point lying on the surface is not occluded by its own face
+bool MeshBVH::occluded(const cv::Vec3f from, const cv::Vec3f to, float epsilon) const
+{
+	if (nodes.empty())
+		return false;
+	float origin[3] = {from[0], from[1], from[2]},
+	      direction[3] = {to[0]-from[0], to[1]-from[1], to[2]-from[2]},
+	      invDirection[3];
+	float length = sqrt(dot3(direction, direction));
+	if (length <= 2*epsilon)
+		return false;
+	// the segment is parametrized as origin + t*direction, t in [tMin, tMax]
+	float tMin = epsilon / length, tMax = 1 - tMin;
+	for (int j=0; j<3; j++) {
+		// avoid infinities, as these would produce NaN's in the slab test
+		invDirection[j] = (direction[j] != 0) ? 1 / direction[j] : 1e30;
+	}
+
+	int stack[maxDepth];
+	int stackSize = 0;
+	stack[stackSize++] = 0;
+	while (stackSize > 0) {
+		const Node &node = nodes[stack[--stackSize]];
+
+		// slab test against the bounding box
+		float nearT = tMin, farT = tMax;
+		for (int j=0; j<3; j++) {
+			float t0 = (node.lower[j] - origin[j]) * invDirection[j],
+			      t1 = (node.upper[j] - origin[j]) * invDirection[j];
+			nearT = IMAX(nearT, IMIN(t0, t1));
+			farT = IMIN(farT, IMAX(t0, t1));
+		}
+		if (nearT > farT)
+			continue;
+
+		if (node.count == 0) {
+			stack[stackSize++] = node.offset;
+			stack[stackSize++] = &node - &nodes[0] + 1;
+			continue;
+		}
+
+		// Moeller-Trumbore intersection with each face in the leaf
+		for (int i=node.offset; i < node.offset + node.count; i++) {
+			const Triangle &face = triangles[i];
+			float p[3], q[3], s[3];
+			cross3(direction, face.edgeC, p);
+			float det = dot3(face.edgeB, p);
+			if (det == 0)
+				continue;
+			float invDet = 1 / det;
+			for (int j=0; j<3; j++)
+				s[j] = origin[j] - face.vertex[j];
+			float u = dot3(s, p) * invDet;
+			if (u < 0 || u > 1)
+				continue;
+			cross3(s, face.edgeB, q);
+			float v = dot3(direction, q) * invDet;
+			if (v < 0 || u + v > 1)
+				continue;
+			float t = dot3(face.edgeC, q) * invDet;
+			if (t > tMin && t < tMax)
+				return true;
+		}
+	}
+	return false;
+}
@@ -8,6 +8,7 @@
 #include <set>
 #include <getopt.h>
 #include <cstdio>
+#include <cstring>
 #include <libgen.h> // needed for dirname(char*)
 const char dirDelimiter = '/';
 using namespace cv; // sorry for this...
@@ -20,10 +21,10 @@ Configuration::Configuration(int argc, char** argv)
 	outFileName = (char*)"output.obj";
 	verbosity = 0;
 	doEstimateExposure = false;
-	useFarneback = false;
+	flowMethod = FLOW_HORN_SCHUNCK;
 	
 	iterationCount = 2;
-	sceneResolution = 1;
+	sceneResolution = 0;
 	cameraThreshold = 10.;
 	scalingFactor = 1.;
 	skipFrames = 1;
@@ -40,14 +41,16 @@ Configuration::Configuration(int argc, char** argv)
 			{"iterations", required_argument, 0, 'n' },
 			{"scale", required_argument, 0, 's' },
 			{"skip-frames", required_argument, 0, 'k' },
+			{"resolution", required_argument, 0, 'r' },
 			{"farneback",   no_argument, 0,  'f' },
+			{"flow",   required_argument, 0,  'F' },
 			{"verbose", no_argument,       0,  'v' },
 			{"hyper-verbose", no_argument,       0,  'V' },
 			{"help",    no_argument,       0,  'h' },
 			{0,         0,                 0,  0 }
 		};
 		
-		char c = getopt_long(argc, argv, "i:m:o:c:en:s:k:fvVh", long_options, &option_index);
+		char c = getopt_long(argc, argv, "i:m:o:c:en:s:k:r:fF:vVh", long_options, &option_index);
 		if (c == -1)
 			break;
 		
@@ -88,8 +91,29 @@ Configuration::Configuration(int argc, char** argv)
 				skipFrames = atoi(optarg);
 				break;
 			
+			case 'r':
+				{
+					float tmp = atof(optarg);
+					if (tmp >= 0)
+						sceneResolution = tmp;
+				}
+				break;
+			
 			case 'f':
-				useFarneback = true;
+				flowMethod = FLOW_FARNEBACK;
+				break;
+			
+			case 'F':
+				if (!strcmp(optarg, "hs"))
+					flowMethod = FLOW_HORN_SCHUNCK;
+				else if (!strcmp(optarg, "farneback"))
+					flowMethod = FLOW_FARNEBACK;
+				else if (!strcmp(optarg, "dis"))
+					flowMethod = FLOW_DIS;
+				else {
+					fprintf(stderr, "Unknown optical flow method %s, exiting.\n", optarg);
+					exit(1);
+				}
 				break;
 			
 			case 'v':
@@ -107,13 +131,15 @@ Configuration::Configuration(int argc, char** argv)
 				printf("Reconstructs dense geometry from given YAML scene calibration and video\n\n");
 				printf("  -c, --camera-threshold=f  use given threshold for camera selection (default: 10)\n");
 				printf("  -e, --estimate-exposure   try to normalize exposure over time (default: false)\n");
-				printf("  -f, --farneback           use Farneback's algorithm for optical flow, intsead of Horn & Schunck's (default: false)\n");
+				printf("  -f, --farneback           use Farneback's algorithm for optical flow, same as --flow=farneback\n");
+				printf("  -F, --flow=s              optical flow algorithm: 'hs' (Horn & Schunck), 'farneback' or 'dis' (dense inverse search; default: hs)\n");
 				printf("  -h, --help                print this message and exit\n");
 				printf("  -i, --input=s             input configuration file name (.yaml, usually exported from Blender; default: output.obj)\n");
 				printf("  -k, --skip-frames=i       use only every n-th frame of the sequence (default: 1)\n");
 				printf("  -m, --input-mesh=s        load initial scene estimate from given file (.obj, by default not set)\n");
 				printf("  -n, --iterations=i        maximal iteration count of surface reconstruction (default: 2)\n");
 				printf("  -o, --output=s            output mesh file name (.obj)\n");
+				printf("  -r, --resolution=f        triangulated points per radius of point filtering, 0 to use every pixel (default: 0)\n");
 				printf("  -s, --scale=f             downsample the input video by a given factor (default: 1.0)\n");
 				printf("  -v, --verbose             print current task and summarize its results during computation\n");
 				printf("  -V, --hyper-verbose       print out what comes to mind, and save all images at hand\n");
@@ -446,6 +472,11 @@ const std::vector<Mat> Configuration::allCameras() const
 	return vector<Mat> (cameras);
 }
 
+const std::vector<Mat> Configuration::allFrames() const
+{
+	return vector<Mat> (frames);
+}
+
 const float Configuration::near(int frameNo)
 {
 	return nearVals[frameNo];
@@ -2,53 +2,703 @@
 
 #include <opencv2/video/tracking.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
-#include <opencv2/legacy/compat.hpp>
-#include <opencv2/legacy/legacy.hpp>
 #include <vector>
+#include <climits>
+#include <cmath>
+#include <cstring>
+#ifdef __SSE2__
+	#include <emmintrin.h>
+#endif
 
 #ifdef TEST_BUILD
 	#include <iostream>
 	#include <fstream>
 	#include <opencv2/core/core.hpp>
 	#include <opencv2/highgui/highgui.hpp>
+	#define IMIN(a,b) (((a)<(b)) ? (a) : (b))
+	#define IMAX(a,b) (((a)>(b)) ? (a) : (b))
 	typedef cv::Mat Mat;
 #else
 	#include "recon.hpp"
 #endif
 
+// == Horn-Schunck solver ==
+// The flow is solved coarse-to-fine on an image pyramid; on each level, the next image is warped by the current flow estimate
+// and the linearized equations are relaxed by red-black successive over-relaxation, row-parallel
+
+// weight of the data term, relative to the smoothness term
+const float hsLambda = 1./1024;
+// relaxation sweeps on each level of the pyramid
+const int hsIterations = 50;
+// over-relaxation factor, must be in (0, 2)
+const float hsOmega = 1.8;
+// the coarsest level of the pyramid is at least this large in both dimensions
+const int hsMinSize = 16;
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+	#define HS_AVX2
+	#include <immintrin.h>
+#endif
+
+// number of pyramid levels used by the Horn-Schunck solver
+int hsLevelCount(const std::vector<Mat> &pyramid)
+{
+	int count = 1;
+	while (count < pyramid.size() && IMIN(pyramid[count].rows, pyramid[count].cols) >= hsMinSize)
+		count++;
+	return count;
+}
+
+// Precompute image derivatives on each level of the pyramid of the main image
+// coef = lambda / (1 + lambda*(gradX^2 + gradY^2)) is the factor of the pointwise update
+void hsPrepare(const std::vector<Mat> &pyramid, std::vector<Mat> &gradX, std::vector<Mat> &gradY, std::vector<Mat> &coef, float lambda=hsLambda)
+{
+	int levels = hsLevelCount(pyramid);
+	gradX.resize(levels);
+	gradY.resize(levels);
+	coef.resize(levels);
+	for (int l=0; l < levels; l++) {
+		const Mat &image = pyramid[l];
+		gradX[l].create(image.size(), CV_32FC1);
+		gradY[l].create(image.size(), CV_32FC1);
+		coef[l].create(image.size(), CV_32FC1);
+		for (int y=0; y < image.rows; y++) {
+			const float *row = image.ptr<float>(y), *up = image.ptr<float>(IMAX(y-1, 0)), *down = image.ptr<float>(IMIN(y+1, image.rows-1));
+			float *gx = gradX[l].ptr<float>(y), *gy = gradY[l].ptr<float>(y), *k = coef[l].ptr<float>(y);
+			for (int x=0; x < image.cols; x++) {
+				gx[x] = (row[IMIN(x+1, image.cols-1)] - row[IMAX(x-1, 0)]) / 2;
+				gy[x] = (down[x] - up[x]) / 2;
+				k[x] = lambda / (1 + lambda * (gx[x]*gx[x] + gy[x]*gy[x]));
+			}
+		}
+	}
+}
+
+// Update a single pixel: move the flow towards the closest solution of the linearized brightness constancy,
+// given the average of its neighbors
+// constant: temporal derivative minus the part explained by the flow the image was warped by
+inline void hsUpdate(int x, int width, float omega, const float *gradX, const float *gradY, const float *coef, const float *constant,
+	float *u, const float *uUp, const float *uDown, float *v, const float *vUp, const float *vDown)
+{
+	int left = IMAX(x-1, 0), right = IMIN(x+1, width-1);
+	float uAvg = (u[left] + u[right] + uUp[x] + uDown[x]) / 4,
+	      vAvg = (v[left] + v[right] + vUp[x] + vDown[x]) / 4;
+	float t = coef[x] * (gradX[x]*uAvg + gradY[x]*vAvg + constant[x]);
+	u[x] += omega * (uAvg - gradX[x]*t - u[x]);
+	v[x] += omega * (vAvg - gradY[x]*t - v[x]);
+}
+
+#ifdef HS_AVX2
+// Same as hsUpdate on pixels 1, ..., width-2 of a row, eight at a time; only pixels with (x + y) % 2 == color are written
+// the rows above and below are loaded masked, so that their pixels of this color (being written by other threads) are not read
+// returns the first pixel that was not processed
+__attribute__((target("avx2,fma")))
+int hsUpdateRowAVX2(int y, int color, int width, float omega, const float *gradX, const float *gradY, const float *coef, const float *constant,
+	float *u, const float *uUp, const float *uDown, float *v, const float *vUp, const float *vDown)
+{
+	// every other lane, starting with pixel x = 1
+	__m256i mask = ((1 + y + color) % 2 == 0) ? _mm256_setr_epi32(-1, 0, -1, 0, -1, 0, -1, 0) : _mm256_setr_epi32(0, -1, 0, -1, 0, -1, 0, -1);
+	__m256 quarter = _mm256_set1_ps(0.25), omegas = _mm256_set1_ps(omega);
+	int x = 1;
+	for (; x + 8 <= width - 1; x += 8) {
+		__m256 uAvg = _mm256_mul_ps(quarter, _mm256_add_ps(_mm256_add_ps(_mm256_loadu_ps(u+x-1), _mm256_loadu_ps(u+x+1)), _mm256_add_ps(_mm256_maskload_ps(uUp+x, mask), _mm256_maskload_ps(uDown+x, mask)))),
+		       vAvg = _mm256_mul_ps(quarter, _mm256_add_ps(_mm256_add_ps(_mm256_loadu_ps(v+x-1), _mm256_loadu_ps(v+x+1)), _mm256_add_ps(_mm256_maskload_ps(vUp+x, mask), _mm256_maskload_ps(vDown+x, mask))));
+		__m256 gx = _mm256_loadu_ps(gradX+x), gy = _mm256_loadu_ps(gradY+x);
+		__m256 t = _mm256_mul_ps(_mm256_loadu_ps(coef+x), _mm256_fmadd_ps(gx, uAvg, _mm256_fmadd_ps(gy, vAvg, _mm256_loadu_ps(constant+x))));
+		__m256 uOld = _mm256_loadu_ps(u+x), vOld = _mm256_loadu_ps(v+x);
+		__m256 uNew = _mm256_fmadd_ps(omegas, _mm256_sub_ps(_mm256_fnmadd_ps(gx, t, uAvg), uOld), uOld),
+		       vNew = _mm256_fmadd_ps(omegas, _mm256_sub_ps(_mm256_fnmadd_ps(gy, t, vAvg), vOld), vOld);
+		_mm256_maskstore_ps(u+x, mask, uNew);
+		_mm256_maskstore_ps(v+x, mask, vNew);
+	}
+	return x;
+}
+static const bool hasAVX2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+#endif
+
+// Half of a red-black sweep: updates all pixels with (x + y) % 2 == color; pixels of one color depend only on the other one,
+// so the rows can be processed in parallel (as long as no pixel of this color is read from a row processed by another thread)
+class HSSweep: public cv::ParallelLoopBody {
+	public:
+		HSSweep(Mat &u, Mat &v, const Mat &gradX, const Mat &gradY, const Mat &coef, const Mat &constant, int color):
+			u(u), v(v), gradX(gradX), gradY(gradY), coef(coef), constant(constant), color(color) {};
+		void operator()(const cv::Range &range) const {
+			int width = u.cols;
+			for (int y=range.start; y < range.end; y++) {
+				int up = IMAX(y-1, 0), down = IMIN(y+1, u.rows-1);
+				float *uRow = u.ptr<float>(y), *vRow = v.ptr<float>(y);
+				const float *uUp = u.ptr<float>(up), *uDown = u.ptr<float>(down), *vUp = v.ptr<float>(up), *vDown = v.ptr<float>(down),
+				            *gx = gradX.ptr<float>(y), *gy = gradY.ptr<float>(y), *k = coef.ptr<float>(y), *c = constant.ptr<float>(y);
+				int x = (y + color) % 2; // first pixel of this color
+				if (x == 0) {
+					hsUpdate(0, width, hsOmega, gx, gy, k, c, uRow, uUp, uDown, vRow, vUp, vDown);
+					x = 2;
+				}
+				#ifdef HS_AVX2
+				if (hasAVX2) {
+					x = hsUpdateRowAVX2(y, color, width, hsOmega, gx, gy, k, c, uRow, uUp, uDown, vRow, vUp, vDown);
+					if ((x + y) % 2 != color)
+						x++;
+				}
+				#endif
+				for (; x < width; x += 2)
+					hsUpdate(x, width, hsOmega, gx, gy, k, c, uRow, uUp, uDown, vRow, vUp, vDown);
+			}
+		}
+	protected:
+		Mat &u, &v;
+		const Mat &gradX, &gradY, &coef, &constant;
+		int color;
+};
+
+// Convert the next image to float and downscale it to match the given pyramid of the main image
+std::vector<Mat> nextPyramid(const std::vector<Mat> &pyramid, const Mat next, int levels)
+{
+	std::vector<Mat> result(levels);
+	next.convertTo(result[0], CV_32FC1);
+	for (int l=1; l < levels; l++)
+		cv::pyrDown(result[l-1], result[l], pyramid[l].size());
+	return result;
+}
+
+// Continue from the flow of a coarser level, scaled to pixels of a finer level of the given size
+void upscaleFlow(Mat &u, Mat &v, cv::Size size)
+{
+	if (u.size() == size)
+		return;
+	Mat finerU, finerV;
+	cv::resize(u, finerU, size, 0, 0, cv::INTER_LINEAR);
+	cv::resize(v, finerV, size, 0, 0, cv::INTER_LINEAR);
+	u = finerU * (float(size.width) / u.cols);
+	v = finerV * (float(size.height) / v.rows);
+}
+
+// Refine the flow (u, v) on a single level of the pyramid: warp the next image by it, linearize, and relax
+void hsLevel(const Mat image, const Mat next, const Mat gradX, const Mat gradY, const Mat coef, Mat &u, Mat &v, int iterations)
+{
+	// warp the next image by the current flow, and linearize around it
+	Mat mapX(image.size(), CV_32FC1), mapY(image.size(), CV_32FC1), warped;
+	for (int y=0; y < image.rows; y++) {
+		const float *uRow = u.ptr<float>(y), *vRow = v.ptr<float>(y);
+		float *mx = mapX.ptr<float>(y), *my = mapY.ptr<float>(y);
+		for (int x=0; x < image.cols; x++) {
+			mx[x] = x + uRow[x];
+			my[x] = y + vRow[x];
+		}
+	}
+	cv::remap(next, warped, mapX, mapY, cv::INTER_LINEAR, cv::BORDER_REPLICATE);
+	Mat constant(image.size(), CV_32FC1);
+	for (int y=0; y < image.rows; y++) {
+		const float *w = warped.ptr<float>(y), *i = image.ptr<float>(y), *gx = gradX.ptr<float>(y), *gy = gradY.ptr<float>(y),
+		            *uRow = u.ptr<float>(y), *vRow = v.ptr<float>(y);
+		float *c = constant.ptr<float>(y);
+		for (int x=0; x < image.cols; x++)
+			c[x] = w[x] - i[x] - gx[x]*uRow[x] - gy[x]*vRow[x];
+	}
+
+	for (int iteration=0; iteration < iterations; iteration++) {
+		cv::parallel_for_(cv::Range(0, image.rows), HSSweep(u, v, gradX, gradY, coef, constant, 0));
+		cv::parallel_for_(cv::Range(0, image.rows), HSSweep(u, v, gradX, gradY, coef, constant, 1));
+	}
+}
+
+// Calculate the Horn-Schunck optical flow from the main image to next
+// pyramid: the main image converted to float and repeatedly pyrDown'ed; gradX, gradY, coef: as calculated by hsPrepare
+// levels: how many levels of the pyramid to use at most
+// returns the flow as CV_32FC2, in pixels of the main image
+Mat hornSchunck(const std::vector<Mat> &pyramid, const std::vector<Mat> &gradX, const std::vector<Mat> &gradY, const std::vector<Mat> &coef, const Mat next, int iterations=hsIterations, int levels=INT_MAX)
+{
+	levels = IMIN(levels, (int)gradX.size());
+	std::vector<Mat> nexts = nextPyramid(pyramid, next, levels);
+	Mat u = Mat::zeros(pyramid[levels-1].size(), CV_32FC1), v = u.clone();
+	for (int l=levels-1; l >= 0; l--) {
+		upscaleFlow(u, v, pyramid[l].size());
+		hsLevel(pyramid[l], nexts[l], gradX[l], gradY[l], coef[l], u, v, iterations);
+	}
+
+	Mat flow;
+	Mat channels[] = {u, v};
+	cv::merge(channels, 2, flow);
+	return flow;
+}
+
+// == Dense inverse search ==
+// Patches of the main image are aligned to the next image independently by inverse compositional Lucas-Kanade,
+// then densified by a weighted average and refined by a few Horn-Schunck sweeps; all of this coarse-to-fine
+// after Kroeger et al.: Fast Optical Flow using Dense Inverse Search, 2016
+
+// patch size is fixed by the SIMD kernels: each row is two vectors of four floats
+const int disPatchSize = 8;
+// distance of neighboring patches
+const int disPatchStride = 4;
+// Lucas-Kanade iterations for each patch
+const int disIterations = 12;
+// Horn-Schunck sweeps after densification on each level
+const int disRefinement = 5;
+// the next image is padded by this many pixels, so that patches can be sampled without bounds checking
+const int disBorder = 16;
+
+// Sample a patch of the image at a fractional position by bilinear interpolation; the patch must lie within the image
+// the interpolation weights are the same for all pixels of the patch
+inline void samplePatch(const Mat &image, float x, float y, float *out)
+{
+	int x0 = floor(x), y0 = floor(y);
+	float fx = x - x0, fy = y - y0;
+	float w00 = (1-fx)*(1-fy), w01 = fx*(1-fy), w10 = (1-fx)*fy, w11 = fx*fy;
+	#ifdef __SSE2__
+	__m128 v00 = _mm_set1_ps(w00), v01 = _mm_set1_ps(w01), v10 = _mm_set1_ps(w10), v11 = _mm_set1_ps(w11);
+	#endif
+	for (int r=0; r < disPatchSize; r++) {
+		const float *a = image.ptr<float>(y0+r) + x0, *b = image.ptr<float>(y0+r+1) + x0;
+		float *o = out + r*disPatchSize;
+		#ifdef __SSE2__
+		for (int c=0; c < disPatchSize; c += 4) {
+			__m128 top = _mm_add_ps(_mm_mul_ps(v00, _mm_loadu_ps(a+c)), _mm_mul_ps(v01, _mm_loadu_ps(a+c+1))),
+			       bottom = _mm_add_ps(_mm_mul_ps(v10, _mm_loadu_ps(b+c)), _mm_mul_ps(v11, _mm_loadu_ps(b+c+1)));
+			_mm_storeu_ps(o+c, _mm_add_ps(top, bottom));
+		}
+		#else
+		for (int c=0; c < disPatchSize; c++)
+			o[c] = w00*a[c] + w01*a[c+1] + w10*b[c] + w11*b[c+1];
+		#endif
+	}
+}
+
+// Sums of gradX*(warped-templ), gradY*(warped-templ) and (warped-templ)^2 over a patch
+inline void patchResidual(const float *warped, const float *templ, const float *gradX, const float *gradY, float &sumX, float &sumY, float &error)
+{
+	const int count = disPatchSize * disPatchSize;
+	#ifdef __SSE2__
+	__m128 sx = _mm_setzero_ps(), sy = _mm_setzero_ps(), se = _mm_setzero_ps();
+	for (int i=0; i < count; i += 4) {
+		__m128 diff = _mm_sub_ps(_mm_loadu_ps(warped+i), _mm_loadu_ps(templ+i));
+		sx = _mm_add_ps(sx, _mm_mul_ps(_mm_loadu_ps(gradX+i), diff));
+		sy = _mm_add_ps(sy, _mm_mul_ps(_mm_loadu_ps(gradY+i), diff));
+		se = _mm_add_ps(se, _mm_mul_ps(diff, diff));
+	}
+	float bx[4], by[4], be[4];
+	_mm_storeu_ps(bx, sx);
+	_mm_storeu_ps(by, sy);
+	_mm_storeu_ps(be, se);
+	sumX = bx[0] + bx[1] + bx[2] + bx[3];
+	sumY = by[0] + by[1] + by[2] + by[3];
+	error = be[0] + be[1] + be[2] + be[3];
+	#else
+	sumX = sumY = error = 0;
+	for (int i=0; i < count; i++) {
+		float diff = warped[i] - templ[i];
+		sumX += gradX[i] * diff;
+		sumY += gradY[i] * diff;
+		error += diff * diff;
+	}
+	#endif
+}
+
+// Position of the i-th patch along an axis of the given length; the last patch is aligned to the end
+inline int patchPosition(int i, int length)
+{
+	return IMIN(i * disPatchStride, length - disPatchSize);
+}
+
+// Aligns each patch of the main image to the next image, starting at the current dense flow
+class DISPatches: public cv::ParallelLoopBody {
+	public:
+		DISPatches(const Mat &image, const Mat &paddedNext, const Mat &gradX, const Mat &gradY, const Mat &u, const Mat &v, Mat &patchU, Mat &patchV):
+			image(image), paddedNext(paddedNext), gradX(gradX), gradY(gradY), u(u), v(v), patchU(patchU), patchV(patchV) {};
+		void operator()(const cv::Range &range) const {
+			const int count = disPatchSize * disPatchSize;
+			float templ[count], gx[count], gy[count], warped[count];
+			// the patch is kept within the padded image
+			float limitX = paddedNext.cols - disPatchSize - 1, limitY = paddedNext.rows - disPatchSize - 1;
+			for (int j=range.start; j < range.end; j++) {
+				int py = patchPosition(j, image.rows);
+				for (int i=0; i < patchU.cols; i++) {
+					int px = patchPosition(i, image.cols);
+					float hxx = 0, hxy = 0, hyy = 0;
+					for (int r=0; r < disPatchSize; r++) {
+						memcpy(templ + r*disPatchSize, image.ptr<float>(py+r) + px, disPatchSize * sizeof(float));
+						memcpy(gx + r*disPatchSize, gradX.ptr<float>(py+r) + px, disPatchSize * sizeof(float));
+						memcpy(gy + r*disPatchSize, gradY.ptr<float>(py+r) + px, disPatchSize * sizeof(float));
+					}
+					for (int k=0; k < count; k++) {
+						hxx += gx[k]*gx[k];
+						hxy += gx[k]*gy[k];
+						hyy += gy[k]*gy[k];
+					}
+					float det = hxx*hyy - hxy*hxy;
+					float startU = u.at<float>(py + disPatchSize/2, px + disPatchSize/2),
+					      startV = v.at<float>(py + disPatchSize/2, px + disPatchSize/2);
+					float du = startU, dv = startV;
+					if (det > 1e-6 * (hxx + hyy) * (hxx + hyy)) {
+						float sumX, sumY, startError, error;
+						float x = px + disBorder + du, y = py + disBorder + dv;
+						x = IMIN(IMAX(x, 0.f), limitX);
+						y = IMIN(IMAX(y, 0.f), limitY);
+						samplePatch(paddedNext, x, y, warped);
+						patchResidual(warped, templ, gx, gy, sumX, sumY, startError);
+						for (int iteration=0; iteration < disIterations; iteration++) {
+							// inverse compositional step: the Hessian of the template is constant
+							float stepX = (hyy*sumX - hxy*sumY) / det, stepY = (hxx*sumY - hxy*sumX) / det;
+							x = IMIN(IMAX(x - stepX, 0.f), limitX);
+							y = IMIN(IMAX(y - stepY, 0.f), limitY);
+							samplePatch(paddedNext, x, y, warped);
+							patchResidual(warped, templ, gx, gy, sumX, sumY, error);
+							if (stepX*stepX + stepY*stepY < 1e-4)
+								break;
+						}
+						// keep the initial guess if the patch only got worse
+						if (error < startError) {
+							du = x - px - disBorder;
+							dv = y - py - disBorder;
+						}
+					}
+					patchU.at<float>(j, i) = du;
+					patchV.at<float>(j, i) = dv;
+				}
+			}
+		}
+	protected:
+		const Mat &image, &paddedNext, &gradX, &gradY, &u, &v;
+		Mat &patchU, &patchV;
+};
+
+// Dense flow as an average of all patches covering each pixel, weighted by how well each of them matches that pixel
+class DISDensify: public cv::ParallelLoopBody {
+	public:
+		DISDensify(const Mat &image, const Mat &paddedNext, const Mat &patchU, const Mat &patchV, Mat &u, Mat &v):
+			image(image), paddedNext(paddedNext), patchU(patchU), patchV(patchV), u(u), v(v) {};
+		void operator()(const cv::Range &range) const {
+			for (int y=range.start; y < range.end; y++) {
+				float *uRow = u.ptr<float>(y), *vRow = v.ptr<float>(y);
+				const float *imageRow = image.ptr<float>(y);
+				int firstJ = IMAX(0, (y - disPatchSize) / disPatchStride), lastJ = IMIN(patchU.rows - 1, y / disPatchStride + 1);
+				for (int x=0; x < image.cols; x++) {
+					int firstI = IMAX(0, (x - disPatchSize) / disPatchStride), lastI = IMIN(patchU.cols - 1, x / disPatchStride + 1);
+					float weightSum = 0, sumU = 0, sumV = 0;
+					for (int j=firstJ; j <= lastJ; j++) {
+						int py = patchPosition(j, image.rows);
+						if (y < py || y >= py + disPatchSize)
+							continue;
+						for (int i=firstI; i <= lastI; i++) {
+							int px = patchPosition(i, image.cols);
+							if (x < px || x >= px + disPatchSize)
+								continue;
+							float pu = patchU.at<float>(j, i), pv = patchV.at<float>(j, i);
+							float diff = sampleBilinear(x + disBorder + pu, y + disBorder + pv) - imageRow[x];
+							float weight = 1 / IMAX(1.f, fabs(diff));
+							weightSum += weight;
+							sumU += weight * pu;
+							sumV += weight * pv;
+						}
+					}
+					if (weightSum > 0) {
+						uRow[x] = sumU / weightSum;
+						vRow[x] = sumV / weightSum;
+					}
+				}
+			}
+		}
+	protected:
+		float sampleBilinear(float x, float y) const {
+			x = IMIN(IMAX(x, 0.f), paddedNext.cols - 1.001f);
+			y = IMIN(IMAX(y, 0.f), paddedNext.rows - 1.001f);
+			int x0 = x, y0 = y;
+			float fx = x - x0, fy = y - y0;
+			const float *a = paddedNext.ptr<float>(y0) + x0, *b = paddedNext.ptr<float>(y0+1) + x0;
+			return (1-fy) * ((1-fx)*a[0] + fx*a[1]) + fy * ((1-fx)*b[0] + fx*b[1]);
+		}
+		const Mat &image, &paddedNext, &patchU, &patchV;
+		Mat &u, &v;
+};
+
+// Calculate the optical flow from the main image to next by dense inverse search
+// the arguments are the same as for hornSchunck
+Mat denseInverseSearch(const std::vector<Mat> &pyramid, const std::vector<Mat> &gradX, const std::vector<Mat> &gradY, const std::vector<Mat> &coef, const Mat next, int levels=INT_MAX)
+{
+	levels = IMIN(levels, (int)gradX.size());
+	std::vector<Mat> nexts = nextPyramid(pyramid, next, levels);
+	Mat u = Mat::zeros(pyramid[levels-1].size(), CV_32FC1), v = u.clone();
+	for (int l=levels-1; l >= 0; l--) {
+		const Mat &image = pyramid[l];
+		upscaleFlow(u, v, image.size());
+
+		Mat paddedNext;
+		cv::copyMakeBorder(nexts[l], paddedNext, disBorder, disBorder, disBorder, disBorder, cv::BORDER_REPLICATE);
+		int patchesX = (image.cols - disPatchSize + disPatchStride - 1) / disPatchStride + 1,
+		    patchesY = (image.rows - disPatchSize + disPatchStride - 1) / disPatchStride + 1;
+		Mat patchU(patchesY, patchesX, CV_32FC1), patchV(patchesY, patchesX, CV_32FC1);
+		cv::parallel_for_(cv::Range(0, patchesY), DISPatches(image, paddedNext, gradX[l], gradY[l], u, v, patchU, patchV));
+		cv::parallel_for_(cv::Range(0, image.rows), DISDensify(image, paddedNext, patchU, patchV, u, v));
+
+		hsLevel(image, nexts[l], gradX[l], gradY[l], coef[l], u, v, disRefinement);
+	}
+
+	Mat flow;
+	Mat channels[] = {u, v};
+	cv::merge(channels, 2, flow);
+	return flow;
+}
+
+// number of pyramid levels needed to track a motion of maxMotion pixels, so that the coarsest level sees it about one pixel long
+// scale: size ratio of two consecutive levels; maxMotion <= 0 means that the motion is unknown
+int levelsForMotion(float maxMotion, float scale)
+{
+	if (maxMotion <= 0)
+		return INT_MAX;
+	// one more level, to be on the safe side
+	return 2 + (int)ceil(log(IMAX(maxMotion, 1.f)) / log(1 / scale));
+}
+
 #ifndef TEST_BUILD
-Mat calculateFlow(Mat prev, Mat next, bool use_farneback)
+// == Flow variance ==
+// The variance of the flow is estimated from how well the next image warped by the flow matches the main image,
+// summed over a pyramid as in compare(); the full-resolution level is fused with the warp, so that the warped image
+// is never stored, and only the coarser levels (a quarter of the pixels) go through compare()
+
+// rows of the output processed by one task; even, so that each task produces whole rows of the half-resolution level
+const int varianceTileRows = 16;
+
+// Weights of the four taps of cubic convolution at fractional position t, with a = -0.75 as in cv::remap
+inline void cubicWeights(float t, float *w)
+{
+	const float a = -0.75;
+	w[0] = ((a*(t+1) - 5*a)*(t+1) + 8*a)*(t+1) - 4*a;
+	w[1] = ((a+2)*t - (a+3))*t*t + 1;
+	w[2] = ((a+2)*(1-t) - (a+3))*(1-t)*(1-t) + 1;
+	w[3] = 1 - w[0] - w[1] - w[2];
+}
+
+// Sample an 8-bit image by bicubic interpolation, rounded and saturated as cv::remap does; pixels outside the image count as zero
+inline float sampleCubic(const Mat &image, float x, float y)
+{
+	// also rejects NaN's
+	if (!(x > -3 && y > -3 && x < image.cols + 2 && y < image.rows + 2))
+		return 0;
+	int x0 = floor(x), y0 = floor(y);
+	float wx[4], wy[4], sum = 0;
+	cubicWeights(x - x0, wx);
+	cubicWeights(y - y0, wy);
+	x0 -= 1;
+	y0 -= 1;
+	if (x0 >= 0 && y0 >= 0 && x0 + 4 <= image.cols && y0 + 4 <= image.rows) {
+		#ifdef __SSE2__
+		__m128i zero = _mm_setzero_si128();
+		__m128 rows = _mm_setzero_ps();
+		for (int r=0; r < 4; r++) {
+			int32_t taps;
+			memcpy(&taps, image.ptr<uchar>(y0+r) + x0, 4);
+			__m128i pixels = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(taps), zero), zero);
+			rows = _mm_add_ps(rows, _mm_mul_ps(_mm_set1_ps(wy[r]), _mm_cvtepi32_ps(pixels)));
+		}
+		float b[4];
+		_mm_storeu_ps(b, _mm_mul_ps(rows, _mm_loadu_ps(wx)));
+		sum = b[0] + b[1] + b[2] + b[3];
+		#else
+		for (int r=0; r < 4; r++) {
+			const uchar *row = image.ptr<uchar>(y0+r) + x0;
+			sum += wy[r] * (wx[0]*row[0] + wx[1]*row[1] + wx[2]*row[2] + wx[3]*row[3]);
+		}
+		#endif
+	} else {
+		for (int r=0; r < 4; r++) {
+			if (y0+r < 0 || y0+r >= image.rows)
+				continue;
+			const uchar *row = image.ptr<uchar>(y0+r);
+			for (int c=0; c < 4; c++) {
+				if (x0+c >= 0 && x0+c < image.cols)
+					sum += wy[r] * wx[c] * row[x0+c];
+			}
+		}
+	}
+	return IMIN(IMAX(cvRound(sum), 0), 255);
+}
+
+// Downscale two rows of an image by averaging 2x2 blocks; blocks cut by the border of the image average just the pixels present
+// a, b: the two rows (the same row at the bottom border), width: their length, out: row of (width+1)/2 pixels
+inline void halveRows(const float *a, const float *b, int width, float *out)
+{
+	int x = 0;
+	#ifdef __SSE2__
+	__m128 quarter = _mm_set1_ps(0.25);
+	for (; 2*x + 8 <= width; x += 4) {
+		__m128 a0 = _mm_loadu_ps(a + 2*x), a1 = _mm_loadu_ps(a + 2*x + 4),
+		       b0 = _mm_loadu_ps(b + 2*x), b1 = _mm_loadu_ps(b + 2*x + 4);
+		__m128 even = _mm_add_ps(_mm_shuffle_ps(a0, a1, _MM_SHUFFLE(2,0,2,0)), _mm_shuffle_ps(b0, b1, _MM_SHUFFLE(2,0,2,0))),
+		       odd = _mm_add_ps(_mm_shuffle_ps(a0, a1, _MM_SHUFFLE(3,1,3,1)), _mm_shuffle_ps(b0, b1, _MM_SHUFFLE(3,1,3,1)));
+		_mm_storeu_ps(out + x, _mm_mul_ps(quarter, _mm_add_ps(even, odd)));
+	}
+	#endif
+	for (; 2*x < width; x++) {
+		int x1 = IMIN(2*x + 1, width - 1);
+		out[x] = 0.25 * (a[2*x] + a[x1] + b[2*x] + b[x1]);
+	}
+}
+
+// Downscale a float image by two, as halveRows does
+Mat halveImage(const Mat image)
+{
+	Mat result((image.rows+1)/2, (image.cols+1)/2, CV_32FC1);
+	for (int y=0; y < result.rows; y++)
+		halveRows(image.ptr<float>(2*y), image.ptr<float>(IMIN(2*y+1, image.rows-1)), image.cols, result.ptr<float>(y));
+	return result;
+}
+
+// Warps the next image by the flow, a tile of rows at a time, and writes (flow, |main - warped|, 0) to each pixel of the packed result;
+// the warped rows are kept just long enough to downscale them into the half-resolution level
+class VarianceTiles: public cv::ParallelLoopBody {
+	public:
+		VarianceTiles(const Mat &flow, const Mat &image, const Mat &next, Mat &result, Mat &half):
+			flow(flow), image(image), next(next), result(result), half(half) {};
+		void operator()(const cv::Range &range) const
+		{
+			std::vector<float> warped(2 * flow.cols), unpacked(4 * flow.cols);
+			for (int tile=range.start; tile < range.end; tile++) {
+				for (int y = tile*varianceTileRows; y < IMIN((tile+1)*varianceTileRows, flow.rows); y += 2) {
+					int count = IMIN(2, flow.rows - y);
+					for (int dy=0; dy < count; dy++) {
+						const float *f = flow.ptr<float>(y+dy), *m = image.ptr<float>(y+dy);
+						float *w = &warped[dy * flow.cols], *out = &unpacked[0];
+						for (int x=0; x < flow.cols; x++) {
+							w[x] = sampleCubic(next, x + f[2*x], y + dy + f[2*x+1]);
+							#ifdef __SSE2__
+							_mm_storeu_ps(out + 4*x, _mm_setr_ps(f[2*x], f[2*x+1], fabs(m[x] - w[x]), 0));
+							#else
+							out[4*x] = f[2*x];
+							out[4*x+1] = f[2*x+1];
+							out[4*x+2] = fabs(m[x] - w[x]);
+							out[4*x+3] = 0;
+							#endif
+						}
+						packHalf(out, result.ptr<uint16_t>(y+dy), 4 * flow.cols);
+					}
+					halveRows(&warped[0], &warped[(count-1) * flow.cols], flow.cols, half.ptr<float>(y/2));
+				}
+			}
+		}
+	protected:
+		const Mat &flow, &image, &next;
+		Mat &result, &half;
+};
+
+// Adds the differences summed over the coarser levels, upscaled bilinearly, to the variance channel of the result
+class VarianceUpscale: public cv::ParallelLoopBody {
+	public:
+		VarianceUpscale(const Mat &coarse, Mat &result): coarse(coarse), result(result) {};
+		void operator()(const cv::Range &range) const
+		{
+			// pixel centers of the result in coordinates of the coarse level
+			std::vector<int> left(result.cols), right(result.cols);
+			std::vector<float> weight(result.cols), unpacked(4 * result.cols);
+			for (int x=0; x < result.cols; x++)
+				upscaledPosition(x, coarse.cols, left[x], right[x], weight[x]);
+			for (int y=range.start; y < range.end; y++) {
+				int top, bottom;
+				float fy;
+				upscaledPosition(y, coarse.rows, top, bottom, fy);
+				const float *a = coarse.ptr<float>(top), *b = coarse.ptr<float>(bottom);
+				float *out = &unpacked[0];
+				unpackHalf(result.ptr<uint16_t>(y), out, 4 * result.cols);
+				for (int x=0; x < result.cols; x++) {
+					float upper = a[left[x]] + weight[x] * (a[right[x]] - a[left[x]]),
+					      lower = b[left[x]] + weight[x] * (b[right[x]] - b[left[x]]);
+					out[4*x+2] += upper + fy * (lower - upper);
+				}
+				packHalf(out, result.ptr<uint16_t>(y), 4 * result.cols);
+			}
+		}
+	protected:
+		static void upscaledPosition(int i, int length, int &low, int &high, float &weight)
+		{
+			float position = IMIN(IMAX((i + 0.5f) / 2 - 0.5f, 0.f), length - 1.f);
+			low = floor(position);
+			high = IMIN(low + 1, length - 1);
+			weight = position - low;
+		}
+		const Mat &coarse;
+		Mat &result;
+};
+
+FlowContext::FlowContext(const Mat prev, FlowMethod method): prev(prev), method(method)
+{
+	prevPyramid = comparePyramid(prev);
+	if (prevPyramid.size() > 1)
+		halfPyramid = comparePyramid(halveImage(prevPyramid[0]));
+	if (method != FLOW_FARNEBACK)
+		hsPrepare(prevPyramid, gradX, gradY, coef);
+}
+
+Mat calculateFlow(Mat prev, Mat next, FlowMethod method)
+{
+	return FlowContext(prev, method).calculate(next);
+}
+
+// Combine the flow with its estimated variance into a single packed matrix, see floatToHalf()
+// image: the main image as float; halfPyramid: pyramid of the main image downscaled by halveImage, empty if it is too small
+Mat flowVariance(const Mat flow, const Mat image, const Mat next, const std::vector<Mat> &halfPyramid)
+{
+	assert(next.type() == CV_8UC1 && next.size() == flow.size());
+	Mat result(flow.rows, flow.cols, CV_16UC4), half((flow.rows+1)/2, (flow.cols+1)/2, CV_32FC1);
+	int tiles = (flow.rows + varianceTileRows - 1) / varianceTileRows;
+	cv::parallel_for_(cv::Range(0, tiles), VarianceTiles(flow, image, next, result, half));
+	if (!halfPyramid.empty())
+		cv::parallel_for_(cv::Range(0, flow.rows), VarianceUpscale(compare(halfPyramid, half), result));
+	return result;
+}
+
+// calculate flow from the main image to next, along with its estimated variance in each pixel
+// maxMotion: expected length of the longest flow vector in pixels, so that the coarse levels of the pyramid can be skipped; 0 if unknown
+Mat FlowContext::calculate(const Mat next, float maxMotion) const
 {
 	Mat flow;
-	if (use_farneback) {
+	if (method == FLOW_FARNEBACK) {
 		// Calculate flow using Farnebäck's algorithm and some parameters that seem to work the best
 		double pyr_scale = 0.8, poly_sigma = (prev.rows+prev.cols)/1000.0;
-		int levels = 100, winsize = (prev.rows+prev.cols)/100, iterations = 7, poly_n = (poly_sigma<1.5?5:7), flags = 0;
+		int levels = IMIN(100, levelsForMotion(maxMotion, pyr_scale)), winsize = (prev.rows+prev.cols)/100, iterations = 7, poly_n = (poly_sigma<1.5?5:7), flags = 0;
 		cv::calcOpticalFlowFarneback(prev, next, flow, pyr_scale, levels, winsize, iterations, poly_n, poly_sigma, flags);
-	} else {
-		// calculate flow using the Horn&Schunck scheme
-		// needs some conversions for OpenCV 1.x
-		CvMat *velx = cvCreateMat(prev.rows, prev.cols, CV_32FC1), *vely = cvCreateMat(prev.rows, prev.cols, CV_32FC1);
-		flow = Mat(prev.rows, prev.cols, CV_32FC2);
-		double epsilon = 1e-10;
-		CvTermCriteria crit = {CV_TERMCRIT_ITER+CV_TERMCRIT_EPS, 300, epsilon};
-		CvMat prevm = prev, nextm = next;
-		cvCalcOpticalFlowHS(&prevm, &nextm, false, velx, vely, 1./1024, crit);
-		int fromTo[] = {0,0, 1,1};
-		Mat combi[] = {Mat(velx), Mat(vely)};
-		cv::mixChannels(combi, 2, &flow, 1, fromTo, 2);
-		cvReleaseMat(&velx);
-		cvReleaseMat(&vely);
-	}
-	// estimate the variance in each pixel
-	Mat variance = compare(prev, flowRemap(flow, next));
-	
-	// combine all the values into a single matrix
-	Mat mixInput[] = {flow, variance};
-	Mat mixed(flow.rows, flow.cols, CV_32FC4); // opencv does weird things if channel count is not 4...
-	int fromTo[] = {0,0, 1,1, 2,2, -1,3};
-	cv::mixChannels(mixInput, 2, &mixed, 1, fromTo, 4);
-	return mixed;
+	} else if (method == FLOW_HORN_SCHUNCK) {
+		// calculate flow using the Horn&Schunck scheme, reusing the derivatives of the main image
+		flow = hornSchunck(prevPyramid, gradX, gradY, coef, next, hsIterations, levelsForMotion(maxMotion, 0.5));
+	} else if (method == FLOW_DIS) {
+		flow = denseInverseSearch(prevPyramid, gradX, gradY, coef, next, levelsForMotion(maxMotion, 0.5));
+	}
+	return flowVariance(flow, prevPyramid[0], next, halfPyramid);
+}
+
+// calculates flow to each of the given images, one image per thread
+class FlowWorker: public cv::ParallelLoopBody {
+	public:
+		FlowWorker(const FlowContext &context, const std::vector<Mat> &nexts, const std::vector<float> &maxMotions, std::vector<Mat> &flows):
+			context(context), nexts(nexts), maxMotions(maxMotions), flows(flows) {};
+		void operator()(const cv::Range &range) const {
+			for (int i=range.start; i < range.end; i++)
+				flows[i] = context.calculate(nexts[i], (i < maxMotions.size()) ? maxMotions[i] : 0);
+		}
+	protected:
+		const FlowContext &context;
+		const std::vector<Mat> &nexts;
+		const std::vector<float> &maxMotions;
+		std::vector<Mat> &flows;
+};
+
+std::vector<Mat> FlowContext::calculate(const std::vector<Mat> nexts, const std::vector<float> maxMotions) const
+{
+	std::vector<Mat> flows(nexts.size());
+	cv::parallel_for_(cv::Range(0, nexts.size()), FlowWorker(*this, nexts, maxMotions, flows));
+	return flows;
+}
+
+// length of the longest flow vector, as returned by calculateFlow
+float maxFlowLength(const Mat flow)
+{
+	float result = 0;
+	for (int i=0; i < flow.rows; i++) {
+		const uint16_t *row = flow.ptr<uint16_t>(i);
+		for (int j=0; j < flow.cols; j++) {
+			float x = halfToFloat(row[4*j]), y = halfToFloat(row[4*j+1]);
+			result = IMAX(result, x*x + y*y);
+		}
+	}
+	return sqrt(result);
 }
 
 #else //ifdef TEST_BUILD
@@ -64,37 +714,35 @@ Mat flowRemap(Mat flow, const Mat image)
 	return remapped;
 }
 
-Mat calculateFlowHS(Mat prev, Mat next, int iterations, double smoothness)
-{
-	CvMat *velx = cvCreateMat(prev.rows, prev.cols, CV_32FC1), *vely = cvCreateMat(prev.rows, prev.cols, CV_32FC1);
-	Mat flow(prev.rows, prev.cols, CV_32FC2);
-	CvMat *prev_gray = cvCreateMat(prev.rows, prev.cols, CV_8UC1), *next_gray = cvCreateMat(prev.rows, prev.cols, CV_8UC1);
-	cv::cvtColor(prev,Mat(prev_gray),CV_BGR2GRAY);
-	cv::cvtColor(next,Mat(next_gray),CV_BGR2GRAY);
-	double epsilon = 1e-10;
-	CvTermCriteria crit = {CV_TERMCRIT_ITER+CV_TERMCRIT_EPS, iterations, epsilon};
-	cvCalcOpticalFlowHS(prev_gray, next_gray, false, velx, vely, smoothness, crit);
-	cvReleaseMat(&prev_gray);
-	cvReleaseMat(&next_gray);
-	int fromTo[] = {0,0, 1,1};
-	Mat combi[] = {Mat(velx), Mat(vely)};
-	cv::mixChannels(combi, 2, &flow, 1, fromTo, 2);
-	cvReleaseMat(&velx);
-	cvReleaseMat(&vely);
-	return flow;
+Mat calculateFlowHS(Mat prev, Mat next, int iterations, double smoothness, bool use_dis)
+{
+	Mat prev_gray, next_gray;
+	cv::cvtColor(prev, prev_gray, CV_BGR2GRAY);
+	cv::cvtColor(next, next_gray, CV_BGR2GRAY);
+	std::vector<Mat> pyramid(1), gradX, gradY, coef;
+	prev_gray.convertTo(pyramid[0], CV_32FC1);
+	while (IMIN(pyramid.back().rows, pyramid.back().cols) > 2) {
+		Mat smaller;
+		cv::pyrDown(pyramid.back(), smaller);
+		pyramid.push_back(smaller);
+	}
+	hsPrepare(pyramid, gradX, gradY, coef, smoothness);
+	if (use_dis)
+		return denseInverseSearch(pyramid, gradX, gradY, coef, next_gray);
+	return hornSchunck(pyramid, gradX, gradY, coef, next_gray, iterations);
 }
 
 int main(int argc, char **argv)
 {
 	if (argc <= 2) {
-		printf("Usage: flow <IMAGE1> <IMAGE2> [(l|w|i|n|p|s)<NUMBER>|g|h]...\n");
+		printf("Usage: flow <IMAGE1> <IMAGE2> [(l|w|i|n|p|s)<NUMBER>|g|h|d]...\n");
 		exit(0);
 	}
 	Mat prev = cv::imread(argv[1]),
 	    next = cv::imread(argv[2]);
 	double pyr_scale = 0.5, poly_sigma = 1.5;
 	int levels = 4, winsize = 20, iterations = 30, poly_n = 5, flags = 0;
-	bool use_hornschunck = false;
+	bool use_hornschunck = false, use_dis = false;
 	for (int i=3; i<argc; i++) {
 		switch(argv[i][0]) {
 			case 'l':
@@ -113,15 +761,21 @@ int main(int argc, char **argv)
 				flags = cv::OPTFLOW_FARNEBACK_GAUSSIAN; break;
 			case 'h':
 				use_hornschunck = true; break;
+			case 'd':
+				use_dis = true; break;
 			default:
 				fprintf(stderr, "Unrecognized option: %s\n", argv[i]);
 		}
 	}
 	//printf("Calculating optflow between %s and %s.\n", argv[1], argv[2]);
 	Mat flow;
-	if (use_hornschunck) {
-		printf("lambda: %g; iterations: %i;\n", poly_sigma, iterations);
-		flow = calculateFlowHS(prev, next, iterations, 1./poly_sigma);
+	int64 start = cv::getTickCount();
+	if (use_dis) {
+		printf("Dense inverse search; refinement lambda: 1/%g;\n", poly_sigma);
+		flow = calculateFlowHS(prev, next, iterations, 1./poly_sigma, true);
+	} else if (use_hornschunck) {
+		printf("lambda: 1/%g; iterations per level: %i;\n", poly_sigma, iterations);
+		flow = calculateFlowHS(prev, next, iterations, 1./poly_sigma, false);
 	} else {
 		printf("Levels: %i; winsize: %i; iterations: %i; polyexpansion size: %i; pyramid scale: %g; sigma: %g; Gaussian: %s\n", levels, winsize, iterations, poly_n, pyr_scale, poly_sigma, (flags?"TRUE":"FALSE"));
 		Mat prev_gray, next_gray;
@@ -130,7 +784,7 @@ int main(int argc, char **argv)
 		cv::calcOpticalFlowFarneback(prev_gray, next_gray, flow, pyr_scale, levels, winsize, iterations, poly_n, poly_sigma, flags);
 	}
 
-	printf("Done.\n");
+	printf("Done in %.1f ms.\n", 1000. * (cv::getTickCount() - start) / cv::getTickFrequency());
 	Mat mixed(flow.rows, flow.cols, CV_32FC3);
 	int fromTo[] = {0,0, 1,1, -1,2};
 	cv::mixChannels(&flow, 1, &mixed, 1, fromTo, 3);
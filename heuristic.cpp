@@ -1,12 +1,28 @@
 // heuristic.cpp: a class encapsulating all the heuristic algorithms used
 
-#include <opencv2/flann/flann.hpp>
 #include "recon.hpp"
 #include <map>
+#include <cmath>
+#include <algorithm>
+
+#define USE_QUANTIZED_WEIGHTS
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+	#define DENSITY_AVX2
+	#include <immintrin.h>
+#endif
 
-typedef cvflann::L2_Simple<float> Distance;
 typedef std::pair<int, float> Neighbor;
+#ifdef USE_QUANTIZED_WEIGHTS
+// weights of the neighbor table, all of which lie in [0, 1], are stored as multiples of weightScale
+typedef uint16_t Weight;
+const float weightScale = 1. / 65535;
+#else
+typedef float Weight;
+const float weightScale = 1;
+#endif
 const float focal = 0.5; // focal length of the camera P used for projection from faces
+const float viewerNear = 0.001; // near value of the camera P, also the distance ignored by visibility tests
 
 // Structure describing a camera selected by the heuristic
 typedef struct {
@@ -51,6 +67,224 @@ inline float const densityFn(float dist, float radius)
 	return (1. - dist/radius);
 }
 
+// points processed by one task when preparing the neighbor table
+const int neighborTileSize = 1024;
+// largest magnitude of a grid cell coordinate, so that far outliers cannot overflow
+const float gridLimit = 1 << 20;
+
+// Uniform grid over the points, with the cells stored in a hash table
+// members of each bucket are stored contiguously and in increasing order of the point index
+typedef struct {
+	float cellSize;
+	unsigned mask; // number of buckets minus one
+	std::vector<cv::Vec3i> cells; // grid cell of each point
+	std::vector<int> bucketStarts, members;
+} PointGrid;
+
+inline unsigned cellHash(const cv::Vec3i cell, unsigned mask)
+{
+	return ((unsigned)cell[0] * 73856093u ^ (unsigned)cell[1] * 19349663u ^ (unsigned)cell[2] * 83492791u) & mask;
+}
+
+// Finds the grid cell and the hash bucket of each point
+class GridCells: public cv::ParallelLoopBody {
+	public:
+		GridCells(const Mat &points3, PointGrid &grid, std::vector<unsigned> &buckets):
+			points3(points3), grid(grid), buckets(buckets) {};
+		void operator()(const cv::Range &range) const
+		{
+			for (int i=range.start; i < range.end; i++) {
+				const float *point = points3.ptr<float>(i);
+				for (int j=0; j<3; j++) {
+					float cell = floor(point[j] / grid.cellSize);
+					// written so that NaN's end up clamped, too
+					if (!(cell > -gridLimit))
+						cell = -gridLimit;
+					if (!(cell < gridLimit))
+						cell = gridLimit;
+					grid.cells[i][j] = cell;
+				}
+				buckets[i] = cellHash(grid.cells[i], grid.mask);
+			}
+		}
+	protected:
+		const Mat &points3;
+		PointGrid &grid;
+		std::vector<unsigned> &buckets;
+};
+
+// Collects the neighbors of each point within a tile into a block of its own, sorted by their index
+// radius bounds the squared distance, which is exactly the same in both directions, so the table is symmetric
+// the number of neighbors of i-th point is stored in counts[i+1]
+class NeighborTiles: public cv::ParallelLoopBody {
+	public:
+		NeighborTiles(const Mat &points3, const PointGrid &grid, float radius, std::vector< std::vector<Neighbor> > &blocks, std::vector<int> &counts):
+			points3(points3), grid(grid), radius(radius), blocks(blocks), counts(counts) {};
+		void operator()(const cv::Range &range) const
+		{
+			for (int tile=range.start; tile < range.end; tile++) {
+				std::vector<Neighbor> &block = blocks[tile];
+				int end = IMIN((tile+1) * neighborTileSize, points3.rows);
+				for (int i=tile * neighborTileSize; i < end; i++) {
+					const float *point = points3.ptr<float>(i);
+					int before = block.size();
+					for (int dz=-1; dz<=1; dz++) for (int dy=-1; dy<=1; dy++) for (int dx=-1; dx<=1; dx++) {
+						cv::Vec3i cell = grid.cells[i] + cv::Vec3i(dx, dy, dz);
+						unsigned bucket = cellHash(cell, grid.mask);
+						for (int k=grid.bucketStarts[bucket]; k < grid.bucketStarts[bucket+1]; k++) {
+							int other = grid.members[k];
+							if (other == i)
+								continue;
+							// other cells may share the bucket
+							if (grid.cells[other] != cell)
+								continue;
+							const float *neighbor = points3.ptr<float>(other);
+							float distance = pow2(point[0] - neighbor[0]) + pow2(point[1] - neighbor[1]) + pow2(point[2] - neighbor[2]);
+							if (distance <= radius)
+								block.push_back(Neighbor(other, densityFn(distance, radius)));
+						}
+					}
+					std::sort(block.begin() + before, block.end());
+					counts[i+1] = block.size() - before;
+				}
+			}
+		}
+	protected:
+		const Mat &points3;
+		const PointGrid &grid;
+		float radius;
+		std::vector< std::vector<Neighbor> > &blocks;
+		std::vector<int> &counts;
+};
+
+// Copies the block of each tile to its place in the neighbor table
+class MergeNeighbors: public cv::ParallelLoopBody {
+	public:
+		MergeNeighbors(const std::vector< std::vector<Neighbor> > &blocks, const std::vector<int> &neighborBlocks, std::vector<int32_t> &neighborIds, std::vector<Weight> &neighborWeights):
+			blocks(blocks), neighborBlocks(neighborBlocks), neighborIds(neighborIds), neighborWeights(neighborWeights) {};
+		void operator()(const cv::Range &range) const
+		{
+			for (int tile=range.start; tile < range.end; tile++) {
+				int offset = neighborBlocks[tile * neighborTileSize];
+				for (int k=0; k < blocks[tile].size(); k++) {
+					neighborIds[offset + k] = blocks[tile][k].first;
+					#ifdef USE_QUANTIZED_WEIGHTS
+					neighborWeights[offset + k] = cvRound(blocks[tile][k].second / weightScale);
+					#else
+					neighborWeights[offset + k] = blocks[tile][k].second;
+					#endif
+				}
+			}
+		}
+	protected:
+		const std::vector< std::vector<Neighbor> > &blocks;
+		const std::vector<int> &neighborBlocks;
+		std::vector<int32_t> &neighborIds;
+		std::vector<Weight> &neighborWeights;
+};
+
+// Sum of density over the given neighbors, weighted by multiples of weightScale
+inline float neighborSum(const float *density, const int32_t *ids, const Weight *weights, int count)
+{
+	float sum = 0;
+	for (int k=0; k < count; k++)
+		sum += density[ids[k]] * weights[k];
+	return sum;
+}
+
+#ifdef DENSITY_AVX2
+// Same as neighborSum, eight neighbors at a time
+__attribute__((target("avx2,fma")))
+float neighborSumAVX2(const float *density, const int32_t *ids, const Weight *weights, int count)
+{
+	__m256 sums = _mm256_setzero_ps();
+	int k = 0;
+	for (; k + 8 <= count; k += 8) {
+		__m256 values = _mm256_i32gather_ps(density, _mm256_loadu_si256((const __m256i *)(ids + k)), 4);
+		#ifdef USE_QUANTIZED_WEIGHTS
+		__m256 w = _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(weights + k))));
+		#else
+		__m256 w = _mm256_loadu_ps(weights + k);
+		#endif
+		sums = _mm256_fmadd_ps(values, w, sums);
+	}
+	__m128 quad = _mm_add_ps(_mm256_castps256_ps128(sums), _mm256_extractf128_ps(sums, 1));
+	quad = _mm_add_ps(quad, _mm_movehl_ps(quad, quad));
+	quad = _mm_add_ss(quad, _mm_shuffle_ps(quad, quad, 1));
+	return _mm_cvtss_f32(quad) + neighborSum(density, ids + k, weights + k, count - k);
+}
+static const bool hasAVX2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+#endif
+
+// One step of the density power iteration: score = neighbor table * density
+// each task gathers the rows of a tile of points, so no two threads write the same score; the sum of each tile goes to sums[tile]
+class DensityProduct: public cv::ParallelLoopBody {
+	public:
+		DensityProduct(const std::vector<int> &neighborBlocks, const std::vector<int32_t> &neighborIds, const std::vector<Weight> &neighborWeights,
+		               const std::vector<float> &density, std::vector<float> &score, std::vector<double> &sums):
+			neighborBlocks(neighborBlocks), neighborIds(neighborIds), neighborWeights(neighborWeights), density(density), score(score), sums(sums) {};
+		void operator()(const cv::Range &range) const
+		{
+			for (int tile=range.start; tile < range.end; tile++) {
+				int end = IMIN((tile+1) * neighborTileSize, (int)score.size());
+				double sum = 0;
+				for (int i=tile * neighborTileSize; i < end; i++) {
+					int begin = neighborBlocks[i], count = neighborBlocks[i+1] - begin;
+					if (count == 0) {
+						score[i] = 0;
+						continue;
+					}
+					const int32_t *ids = &neighborIds[begin];
+					const Weight *weights = &neighborWeights[begin];
+					#ifdef DENSITY_AVX2
+					score[i] = (hasAVX2 ? neighborSumAVX2(&density[0], ids, weights, count) : neighborSum(&density[0], ids, weights, count)) * weightScale;
+					#else
+					score[i] = neighborSum(&density[0], ids, weights, count) * weightScale;
+					#endif
+					sum += score[i];
+				}
+				sums[tile] = sum;
+			}
+		}
+	protected:
+		const std::vector<int> &neighborBlocks;
+		const std::vector<int32_t> &neighborIds;
+		const std::vector<Weight> &neighborWeights;
+		const std::vector<float> &density;
+		std::vector<float> &score;
+		std::vector<double> &sums;
+};
+
+// Sets the density to the normalized and clamped score; the squared change of each tile goes to changes[tile]
+class DensityUpdate: public cv::ParallelLoopBody {
+	public:
+		DensityUpdate(const std::vector<float> &score, float normalizer, std::vector<float> &density, std::vector<double> &changes):
+			score(score), normalizer(normalizer), density(density), changes(changes) {};
+		void operator()(const cv::Range &range) const
+		{
+			for (int tile=range.start; tile < range.end; tile++) {
+				int end = IMIN((tile+1) * neighborTileSize, (int)score.size());
+				double change = 0;
+				for (int i=tile * neighborTileSize; i < end; i++) {
+					// normalize using L1 norm
+					float normalizedDensity = score[i] * normalizer;
+					// apply clamping
+					if (normalizedDensity > 2.)
+						normalizedDensity = 2.;
+					// calculate the total change to stop the iteration if converged
+					change += pow2(density[i] - normalizedDensity);
+					density[i] = normalizedDensity;
+				}
+				changes[tile] = change;
+			}
+		}
+	protected:
+		const std::vector<float> &score;
+		float normalizer;
+		std::vector<float> &density;
+		std::vector<double> &changes;
+};
+
 // Filter outliers and redundant points from the given point cloud
 void Heuristic::filterPoints(Mat& points, Mat& normals)
 {
@@ -59,41 +293,49 @@ void Heuristic::filterPoints(Mat& points, Mat& normals)
 	int pointCount = points.rows;
 	Mat points3 = dehomogenize(points);
 	
-	// guess a filtering radius
-	const float radius = alphaVals.back()/4.;
+	const float radius = filterRadius();
 	
-	// all distances are stored as a single 1D array, for efficiency
-	// range of neighbors corresponding to i-th point is neighbors[neighborBlocks[i], ..., neighborBlocks[i+1]-1]
+	// all neighbors are stored as a single 1D array (in both directions), for efficiency
+	// range of neighbors corresponding to i-th point is neighborIds[neighborBlocks[i], ..., neighborBlocks[i+1]-1], in increasing order
 	std::vector<int> neighborBlocks(pointCount+1, 0);
-	std::vector<Neighbor> neighbors;
+	std::vector<int32_t> neighborIds;
+	std::vector<Weight> neighborWeights;
+	int tiles = (pointCount + neighborTileSize - 1) / neighborTileSize;
 	
 	// == BEGIN Prepare the neighbor table ==
-	neighbors.reserve(pointCount);
-	{
-		// FLANN search structure
-		cv::flann::GenericIndex<Distance> index = cv::flann::GenericIndex<Distance>(points3, cvflann::KDTreeIndexParams());
-		cvflann::SearchParams params;
-		// temporary arrays to extract arguments from FLANN in correct format
-		std::vector<float> distances(pointCount, 0.), point(3, 0.);
-		std::vector<int> indices(pointCount, -1);
-		for (int i=0; i<pointCount; i++) {
-			points3.row(i).copyTo(point);
-			index.radiusSearch(point, indices, distances, radius, params);
-			int writeIndex = 0;
-			neighborBlocks[i] = neighbors.size();
-			int end;
-			for (end = 0; end < indices.size() && indices[end] >= 0; end++);
-			for (int j = 0; j < end; j++) {
-				// to ensure symmetry, take only neighbors with a smaller index (because FLANN is randomized)
-				if (indices[j] < i && distances[j] <= radius)
-					neighbors.push_back(Neighbor(indices[j], densityFn(distances[j], radius)));
-				indices[j] = -1;
-			}
-		}
+	if (radius > 0 && pointCount > 0) {
+		// radius bounds the squared distance (as it did with FLANN's L2_Simple), so the cells must be sqrt(radius) wide
+		PointGrid grid;
+		grid.cellSize = sqrt(radius);
+		grid.mask = 1;
+		while (grid.mask < pointCount)
+			grid.mask <<= 1;
+		grid.mask -= 1;
+		grid.cells.resize(pointCount);
+		std::vector<unsigned> buckets(pointCount);
+		cv::parallel_for_(cv::Range(0, pointCount), GridCells(points3, grid, buckets));
+		// counting sort of the points by their bucket, keeping them ordered by index within the bucket
+		grid.bucketStarts.assign(grid.mask + 2, 0);
+		for (int i=0; i<pointCount; i++)
+			grid.bucketStarts[buckets[i]+1]++;
+		for (unsigned b=0; b <= grid.mask; b++)
+			grid.bucketStarts[b+1] += grid.bucketStarts[b];
+		std::vector<int> fill(grid.bucketStarts.begin(), grid.bucketStarts.end() - 1);
+		grid.members.resize(pointCount);
+		for (int i=0; i<pointCount; i++)
+			grid.members[fill[buckets[i]]++] = i;
+
+		// the table does not depend on the number of threads
+		std::vector< std::vector<Neighbor> > blocks(tiles);
+		cv::parallel_for_(cv::Range(0, tiles), NeighborTiles(points3, grid, radius, blocks, neighborBlocks));
+		for (int i=0; i<pointCount; i++)
+			neighborBlocks[i+1] += neighborBlocks[i];
+		neighborIds.resize(neighborBlocks[pointCount]);
+		neighborWeights.resize(neighborBlocks[pointCount]);
+		cv::parallel_for_(cv::Range(0, tiles), MergeNeighbors(blocks, neighborBlocks, neighborIds, neighborWeights));
 	}
-	neighborBlocks[pointCount] = neighbors.size();
 	if (config->verbosity >= 2)
-		printf(" Neighbors total: %lu, %5.1g per point.\n", neighbors.size(), ((float)neighbors.size())/pointCount);
+		printf(" Neighbors total: %lu, %5.1g per point.\n", neighborIds.size(), ((float)neighborIds.size())/pointCount);
 	// == END Prepare the neighbor table ==
 	
 	if (config->verbosity >= 1)
@@ -103,34 +345,19 @@ void Heuristic::filterPoints(Mat& points, Mat& normals)
 	std::vector<float> density(pointCount, 1.), score(pointCount, 0.);
 	double change;
 	int densityIterationNo = 0;
+	// partial sums of each tile, added up in a fixed order so that the result does not depend on the number of threads
+	std::vector<double> tileSums(tiles);
 	do {
-		for (int i=0; i<pointCount; i++) {
-			score[i] = 0.;
-		}
+		// add the density of each neighbor, weighted by its distance
+		cv::parallel_for_(cv::Range(0, tiles), DensityProduct(neighborBlocks, neighborIds, neighborWeights, density, score, tileSums));
 		double sum = 0.;
-		for (int i=0; i<pointCount; i++) {
-			// add the density of each neighbor, weighted by its distance
-			// and add the density of the current point to the neighbor, to ensure symmetry
-			float densityTemp = 0.0;
-			for (int j = neighborBlocks[i]; j < neighborBlocks[i+1]; j++) {
-				densityTemp += density[neighbors[j].first] * neighbors[j].second;
-				score[neighbors[j].first] += density[i] * neighbors[j].second;
-				sum += (density[i] + density[neighbors[j].first]) * neighbors[j].second;
-			}
-			score[i] += densityTemp;
-		}
+		for (int tile=0; tile<tiles; tile++)
+			sum += tileSums[tile];
 		float normalizer = pointCount / sum;
+		cv::parallel_for_(cv::Range(0, tiles), DensityUpdate(score, normalizer, density, tileSums));
 		change = 0.;
-		for (int i=0; i<pointCount; i++) {
-			// normalize using L1 norm
-			float normalizedDensity = score[i] * normalizer;
-			// apply clamping
-			if (normalizedDensity > 2.)
-				normalizedDensity = 2.;
-			// calculate the total change to stop the iteration if converged
-			change += pow2(density[i] - normalizedDensity);
-			density[i] = normalizedDensity;
-		}
+		for (int tile=0; tile<tiles; tile++)
+			change += tileSums[tile];
 		change /= pointCount;
 		densityIterationNo += 1;
 	} while (change > 1e-6 && densityIterationNo < 200);
@@ -152,10 +379,10 @@ void Heuristic::filterPoints(Mat& points, Mat& normals)
 		if (score[ord] < densityLimit)
 			continue;
 		
-		// subtract density to get rid of close neighbors
-		double localDensity = density[ord];
-		for (int j=neighborBlocks[ord]; j<neighborBlocks[ord+1]; j++) {
-			score[neighbors[j].first] -= localDensity * neighbors[j].second;
+		// subtract density to get rid of close neighbors (those with a smaller index, which come first)
+		double localDensity = density[ord] * weightScale;
+		for (int j=neighborBlocks[ord]; j<neighborBlocks[ord+1] && neighborIds[j] < ord; j++) {
+			score[neighborIds[j]] -= localDensity * neighborWeights[j];
 		}
 		if (i > writeIndex)
 			order[writeIndex] = order[i];
@@ -236,7 +463,7 @@ const Mat faceCamera(const Mesh mesh, int faceIdx, float far, float focal)
 	}
 
 	// constant near value; FIXME, may cause issues and imprecision
-	float near = 0.001;
+	float near = viewerNear;
 	Mat K(cv::Matx44f(
 		focal, 0, 0, 0,
 		0, focal, 0, 0,
@@ -282,15 +509,21 @@ int myFind(std::vector<int> list, int index)
 }
 
 // filter out cameras that do not display the given point on the scene surface
-LabelledCameras filterCameras(Mat viewer, Mat depth, const std::vector<Mat> cameras)
+// cameraCenters: Cartesian centers of all the cameras, in the same order
+// visibility is checked by casting a ray from the point to each camera center
+LabelledCameras filterCameras(Mat viewer, const MeshBVH &bvh, const std::vector<Mat> cameras, const std::vector<cv::Vec3f> &cameraCenters)
 {
 	LabelledCameras filtered;
+	Mat viewerCenter = extractCameraCenter(viewer);
+	const float *vc = viewerCenter.ptr<float>(0);
+	cv::Vec3f viewerPoint(vc[0]/vc[3], vc[1]/vc[3], vc[2]/vc[3]);
 	// go through all cameras and check if each passes all visibility tests
 	{int i=0; for (std::vector<Mat>::const_iterator camera=cameras.begin(); camera!=cameras.end(); camera++, i++) {
 		CameraLabel label;
 		label.index = i;
 		// position of camera center projected from the face viewer matrix P
-		Mat cameraFromViewer = viewer * extractCameraCenter(*camera);
+		const cv::Vec3f &center = cameraCenters[i];
+		Mat cameraFromViewer = viewer * Mat(cv::Vec4f(center[0], center[1], center[2], 1));
 		float *cfv = cameraFromViewer.ptr<float>(0);
 		cameraFromViewer /= cfv[3];
 		
@@ -302,19 +535,15 @@ LabelledCameras filterCameras(Mat viewer, Mat depth, const std::vector<Mat> came
 		}
 		label.viewX = cfv[0];
 		label.viewY = cfv[1];
+		if (cfv[0] < -1 || cfv[0] > 1 || cfv[1] < -1 || cfv[1] > 1)
+			continue;
 		
 		// check that there is no obstacle between the point and the camera
-		int row = (cfv[1] + 1) * depth.rows / 2,
-		    col = (cfv[0] + 1) * depth.cols / 2;
-		if (row < 0 || row >= depth.rows || col < 0 || col > depth.cols)
-			continue;
-		float obstacleDepth = depth.at<float>(row, col);
-		if (obstacleDepth != backgroundDepth && obstacleDepth <= cfv[2]) {
-			//printf("  Failed depth test: %g >= %g\n", cfv[2], obstacleDepth);
+		if (bvh.occluded(viewerPoint, center, viewerNear)) {
+			//printf("  Failed visibility test\n");
 			continue;
 		}
 		
-		Mat viewerCenter = extractCameraCenter(viewer);
 		Mat viewerFromCamera = *camera * viewerCenter;
 		float *vfc = viewerFromCamera.ptr<float>(0);
 		label.distance = vfc[3] / viewerCenter.at<float>(3);
@@ -441,8 +670,18 @@ int Heuristic::chooseCameras(const Mesh mesh, const std::vector<Mat> cameras)
 	float samplingResolution = sqrt(cameras.size())*config->width*config->height/(totalArea * config->cameraThreshold); // units: pixels per scene-space area
 	std::vector<bool> used(false, mesh.faces.rows);
 	cv::RNG random = cv::theRNG();
-	Render *render = spawnRender(*this);
-	render->loadMesh(mesh);
+	// visibility is tested by ray casting against the mesh
+	MeshBVH bvh(mesh);
+	// the cameras do not change between iterations, so their centers are calculated just once
+	if (cameraCenters.size() != cameras.size()) {
+		cameraCenters.clear();
+		cameraCenters.reserve(cameras.size());
+		for (std::vector<Mat>::const_iterator camera=cameras.begin(); camera!=cameras.end(); camera++) {
+			Mat center = extractCameraCenter(*camera);
+			const float *c = center.ptr<float>(0);
+			cameraCenters.push_back(cv::Vec3f(c[0]/c[3], c[1]/c[3], c[2]/c[3]));
+		}
+	}
 	std::vector<int> empty;
 	int shotCount = 200;
 	// table indexed by calling compact(i,j) on two indices
@@ -452,13 +691,12 @@ int Heuristic::chooseCameras(const Mesh mesh, const std::vector<Mat> cameras)
 		float choice = cv::randu<float>() * totalArea;
 		int chosenIdx = bisect(areaSum, choice);
 		
-		// render a view of the scene from that face
+		// view the scene from that face
 		float far = 10; // fixme, may fail. Should be calculated from the scene geometry
 		Mat viewer = faceCamera(mesh, chosenIdx, far, focal);
-		Mat depth = render->depth(viewer);
 		
 		// filter out cameras that do not display this point correctly
-		LabelledCameras filteredCameras = filterCameras(viewer, depth, cameras);
+		LabelledCameras filteredCameras = filterCameras(viewer, bvh, cameras, cameraCenters);
 		if (filteredCameras.size() >= 2) {
 			// try to pick a (main, side) camera pair
 			float mainWeightSum;
@@ -481,7 +719,6 @@ int Heuristic::chooseCameras(const Mesh mesh, const std::vector<Mat> cameras)
 			// no camera pair available for this point on the scene surface
 		}
 	}
-	delete render;
 	
 	// make the list a bit nicer
 	std::sort(chosenCameras.begin(), chosenCameras.end());
@@ -547,8 +784,28 @@ Mesh Heuristic::tessellate(const Mat points, const Mat normals)
 	}
 }
 
+// guess a radius for point filtering, from the current level of detail of the mesh
+float Heuristic::filterRadius()
+{
+	return alphaVals.back()/4.;
+}
+
+// spacing of triangulated points that the filtering can make use of, according to the configured resolution
+float Heuristic::pointSpacing()
+{
+	if (config->sceneResolution <= 0)
+		return 0;
+	return filterRadius() / config->sceneResolution;
+}
+
 // extract frame render size from the configuration (for reprojection)
 cv::Size Heuristic::renderSize()
 {
 	return cv::Size(config->width, config->height);
 }
+
+// A Render instance (of the backend linked in) for the frame size given by the configuration
+Render *spawnRender(Heuristic hint)
+{
+	return spawnRender(hint.renderSize());
+}
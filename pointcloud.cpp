@@ -0,0 +1,61 @@
+// pointcloud.cpp: point cloud that can be appended to from several threads at once
+
+#include "recon.hpp"
+#include <cstring>
+
+PointCloud::PointCloud(int columns): columns(columns), reserved(0)
+{
+	memset(chunks, 0, sizeof(chunks));
+}
+
+PointCloud::~PointCloud()
+{
+	for (int i=0; i < maxChunks; i++)
+		delete[] chunks[i];
+}
+
+// Append all rows of the matrix (CV_32FC1, with the column count of the cloud)
+// space is reserved by an atomic increment, so that concurrent calls only synchronize when they need a new chunk
+void PointCloud::append(const Mat rows)
+{
+	assert(rows.type() == CV_32FC1 && rows.cols == columns);
+	if (rows.rows == 0)
+		return;
+	int begin = __sync_fetch_and_add(&reserved, rows.rows), end = begin + rows.rows;
+	assert(end <= maxChunks * chunkRows);
+	for (int i=begin; i < end; ) {
+		int chunkNo = i / chunkRows, count = IMIN(end, (chunkNo + 1) * chunkRows) - i;
+		float *chunk = chunks[chunkNo];
+		if (!chunk) {
+			// whoever installs the chunk first wins, the others throw theirs away
+			float *fresh = new float[chunkRows * columns];
+			if (__sync_bool_compare_and_swap(&chunks[chunkNo], (float *)NULL, fresh))
+				chunk = fresh;
+			else {
+				delete[] fresh;
+				chunk = chunks[chunkNo];
+			}
+		}
+		float *out = chunk + (i - chunkNo * chunkRows) * columns;
+		for (int j=0; j < count; j++)
+			memcpy(out + j * columns, rows.ptr<float>(i - begin + j), columns * sizeof(float));
+		i += count;
+	}
+}
+
+// number of rows appended so far
+int PointCloud::size() const
+{
+	return reserved;
+}
+
+// All rows in a single matrix; no append may be running at the same time
+Mat PointCloud::contiguous() const
+{
+	Mat result(reserved, columns, CV_32FC1);
+	for (int begin=0; begin < reserved; begin += chunkRows) {
+		int count = IMIN(reserved - begin, chunkRows);
+		memcpy(result.ptr<float>(begin), chunks[begin / chunkRows], count * columns * sizeof(float));
+	}
+	return result;
+}
@@ -2,12 +2,20 @@
 
 // main header 
 #include "recon.hpp"
+#include <map>
 
 // purely for debugging purposes (when executed with -v or -V)
 #include <stdio.h>
 #include <string.h>
 #define logprint(config, level, ...) {if ((config).verbosity >= (level)) printf(__VA_ARGS__);}
 
+// pixels around the foreground of each main frame that the flow is calculated on, to give it some context
+const int roiMargin = 32;
+
+// depth maps of the main cameras are rendered in chunks that cover about this many pixels in each dimension
+// (the size of the depth atlas in render_glx.cpp), so that only a few of them are kept in memory at once
+const int depthChunkSize = 4096;
+
 // application entry point 
 int main(int argc, char ** argv) {
 	// loads the reconstruction parameters from command-line parameters and the video+calibration from external files 
@@ -19,6 +27,7 @@ int main(int argc, char ** argv) {
 
 	// intitialize off-screen rendering (create OpenGL context, ...) 
 	Render *render = spawnRender(hint);
+	render->loadFrames(config.allFrames());
 
 	// store the points from the initial reconstruction 
 	Mat points = config.reconstructedPoints();
@@ -26,6 +35,9 @@ int main(int argc, char ** argv) {
 
 	// initialize normals to zero vectors 
 	Mat normals(Mat::zeros(points.rows, 3, CV_32FC1));
+
+	// length of the longest flow vector for each (main, side) pair of cameras in the previous iteration
+	std::map<std::pair<int, int>, float> pairMotion;
 	
 	// iterate until the heuristic is happy with the precission
 	while (hint.notHappy(points)) {
@@ -60,14 +72,34 @@ int main(int argc, char ** argv) {
 			}
 		}
 
+		// depth maps of the main cameras are calculated several at once, as the main cameras are processed
+		std::vector<Mat> mainCameras, depths;
+		for (int fa = hint.beginMain(); fa != Heuristic::sentinel; fa = hint.nextMain())
+			mainCameras.push_back(config.camera(fa));
+		cv::Size renderSize = hint.renderSize();
+		int depthChunk = IMAX(1, (depthChunkSize / renderSize.width) * (depthChunkSize / renderSize.height));
+
 		// construct an improved version of the point cloud 
+		// rows of the form (x, y, z, w, nx, ny, nz), starting with the current points
 		logprint(config, 1, "Tracking the whole clip...\n");
-		for (int fa = hint.beginMain(); fa != Heuristic::sentinel; fa = hint.nextMain()) {
+		PointCloud cloud(4+3);
+		{
+			Mat current;
+			cv::hconcat(points, normals, current);
+			cloud.append(current);
+		}
+		{int mainNo=0; for (int fa = hint.beginMain(); fa != Heuristic::sentinel; fa = hint.nextMain(), mainNo++) {
 			// * we now have one main camera with the index fa * 
 
-			// load main camera's image and calculate its depth map 
+			// load main camera's image and its depth map, rendering the next chunk of depth maps if necessary
+			// the map is dropped from the chunk, so that it is freed as soon as this frame is processed
+			if (mainNo % depthChunk == 0) {
+				std::vector<Mat> chunk(mainCameras.begin() + mainNo, mainCameras.begin() + IMIN(mainNo + depthChunk, (int)mainCameras.size()));
+				depths = render->depthBatch(chunk);
+			}
 			Mat originalImage = config.frame(fa);
-			Mat depth = render->depth(config.camera(fa));
+			Mat depth = depths[mainNo % depthChunk];
+			depths[mainNo % depthChunk].release();
 			if (config.verbosity >= 3) {
 				char filename[300];
 				snprintf(filename, 300, "frame%i.png", fa);
@@ -76,31 +108,68 @@ int main(int argc, char ** argv) {
 				saveImage(depth, filename, true);
 			}
 
+			// process only the part of the frame covered by the mesh
+			cv::Rect roi = foregroundBounds(depth, roiMargin);
+			if (roi.area() == 0) {
+				logprint(config, 2, " Main frame %i does not see the mesh, skipping\n", fa);
+				continue;
+			}
+			Mat mainImage = originalImage(roi), mainDepth = depth(roi);
+
 			// calculate optical between the main camera and each side view reprojected by our method
 			MatList flows, cameras;
-			for (int fb = hint.beginSide(fa); fb != Heuristic::sentinel; fb = hint.nextSide(fa)) {
-				// * we now have main camera and a side view * 
+			std::vector<int> sides;
+			for (int fb = hint.beginSide(fa); fb != Heuristic::sentinel; fb = hint.nextSide(fa))
+				sides.push_back(fb);
+
+			// calculate prediction frames from all the side cameras
+			// the next one is being rendered while we mix the previous one with the background
+			std::vector<Mat> projectedImages, backgroundMasks;
+			RenderFuture nextProjected;
+			if (!sides.empty())
+				nextProjected = render->projectedAsync(config.camera(fa), sides[0], config.camera(sides[0]));
+			for (int sideNo = 0; sideNo < sides.size(); sideNo++) {
+				Mat projectedImage = nextProjected.get();
+				if (sideNo + 1 < sides.size())
+					nextProjected = render->projectedAsync(config.camera(fa), sides[sideNo+1], config.camera(sides[sideNo+1]));
+				projectedImages.push_back(mixBackground(projectedImage(roi), mainImage, mainDepth));
+				if (config.verbosity >= 3) {
+					Mat mask;
+					cv::compare(mainDepth, backgroundDepth, mask, cv::CMP_EQ);
+					backgroundMasks.push_back(mask);
+				}
+			}
 
-				// calculate prediction frame from the side camera 
-				Mat projectedImage = render->projected(config.camera(fa), config.frame(fb), config.camera(fb));
-				projectedImage = mixBackground(projectedImage, originalImage, depth);
+			// calculate the flows, all side cameras at once
+			// the mesh is refined in each iteration, so the flow of a pair seen before is expected to be shorter than last time
+			std::vector<float> maxMotions(sides.size(), 0);
+			for (int sideNo = 0; sideNo < sides.size(); sideNo++) {
+				std::map<std::pair<int, int>, float>::iterator previous = pairMotion.find(std::make_pair(fa, sides[sideNo]));
+				if (previous != pairMotion.end())
+					maxMotions[sideNo] = previous->second;
+			}
+			FlowContext flowContext(mainImage, config.flowMethod);
+			std::vector<Mat> sideFlows = flowContext.calculate(projectedImages, maxMotions);
 
-				// calculate the flow 
-				Mat flow = calculateFlow(originalImage, projectedImage, config.useFarneback);
+			for (int sideNo = 0; sideNo < sides.size(); sideNo++) {
+				// * we now have main camera and a side view * 
+				int fb = sides[sideNo];
+				Mat flow = sideFlows[sideNo];
+				pairMotion[std::make_pair(fa, fb)] = maxFlowLength(flow);
 				if (config.verbosity >= 3) {
 					char filename[300];
 					snprintf(filename, 300, "project-frame%ifrom%i.png", fa, fb);
-					Mat mask;
-					cv::compare(depth, backgroundDepth, mask, cv::CMP_EQ);
-					projectedImage.setTo(0, mask);
-					saveImage(projectedImage, filename);
+					Mat projectedImage = projectedImages[sideNo];
+					projectedImage.setTo(0, backgroundMasks[sideNo]);
+					saveImage(uncrop(projectedImage, roi, depth.size()), filename);
 					snprintf(filename, 300, "flow-frame%ifrom%i.png", fa, fb);
-					saveImage(flow, filename, true);
-					Mat remapped = flowRemap(flow, projectedImage);
+					Mat unpacked = unpackFlow(flow);
+					saveImage(uncrop(unpacked, roi, depth.size()), filename, true);
+					Mat remapped = flowRemap(unpacked, projectedImage);
 					snprintf(filename, 300, "frame%ifrom%i-remapped.png", fa, fb);
-					saveImage(remapped, filename);
+					saveImage(uncrop(remapped, roi, depth.size()), filename);
 					snprintf(filename, 300, "frame%ifrom%i-remap-error.png", fa, fb);
-					saveImage(compare(originalImage, remapped), filename, true);
+					saveImage(uncrop(compare(mainImage, remapped), roi, depth.size()), filename, true);
 				}
 				
 				// insert the result so that we can use it in the triangulation part 
@@ -111,13 +180,19 @@ int main(int argc, char ** argv) {
 
 			// triangulate all the pixels 
 			// note that the resulting matrix contains rows of the form (x, y, z, w, nx, ny, nz)
-			Mat triangData = triangulatePixels(flows, config.camera(fa), cameras, depth);
-			points.push_back(triangData.colRange(0,4));
-			normals.push_back(triangData.colRange(4,7));
+			float spacing = hint.pointSpacing();
+			int stride = pixelStride(depth, config.camera(fa), roi, spacing);
+			logprint(config, 2, " Triangulating every %i. pixel of main frame %i (point spacing %g)\n", stride, fa, spacing);
+			cloud.append(triangulatePixels(flows, config.camera(fa), cameras, depth, roi, stride));
 			cameras.push_back(config.camera(fa));
-			logprint(config, 2, " After processing main frame %i: %i points\n", fa, points.rows);
-		}
+			logprint(config, 2, " After processing main frame %i: %i points\n", fa, cloud.size());
+		}}
 		// end of the for cycle going through all main cameras 
+		{
+			Mat all = cloud.contiguous();
+			all.colRange(0,4).copyTo(points);
+			all.colRange(4,7).copyTo(normals);
+		}
 
 		// select a reliable subset of the points  
 		if (config.verbosity >= 3)
@@ -19,9 +19,6 @@ typedef cv::Mat Mat;
 typedef struct Mesh{
 	Mat vertices, faces;
 	Mesh(Mat v, Mat f):vertices(v), faces(f) {};} Mesh;
-typedef struct DensityPoint{
-	Mat point; float density;
-	DensityPoint(Mat p, float d):point(p), density(d) {};} DensityPoint;
 typedef std::list<Mat> MatList;
 
 class Configuration;
@@ -29,6 +26,49 @@ class Heuristic;
 
 const float backgroundDepth = 1.0;
 
+// Flows are passed around packed as CV_16UC4 matrices of half-precision floats (flow x, flow y, variance, unused), 8 bytes per pixel
+// conversion of single values, rounding to nearest even; see packHalf() and unpackHalf() for whole rows
+inline uint16_t floatToHalf(float value)
+{
+	union {float f; uint32_t u;} bits, denormal;
+	bits.f = value;
+	uint32_t sign = bits.u & 0x80000000u;
+	bits.u ^= sign;
+	uint16_t result;
+	if (bits.u >= (127+16) << 23) {
+		// too large, infinity or NaN
+		result = (bits.u > 255u << 23) ? 0x7e00 : 0x7c00;
+	} else if (bits.u < 113 << 23) {
+		// subnormal or zero, let the floating point addition do the rounding
+		denormal.u = ((127-15) + (23-10) + 1) << 23;
+		bits.f += denormal.f;
+		result = bits.u - denormal.u;
+	} else {
+		uint32_t odd = (bits.u >> 13) & 1;
+		bits.u += ((15-127) << 23) + 0xfff + odd;
+		result = bits.u >> 13;
+	}
+	return result | (sign >> 16);
+}
+inline float halfToFloat(uint16_t half)
+{
+	union {float f; uint32_t u;} bits, denormal;
+	bits.u = (half & 0x7fff) << 13;
+	uint32_t exponent = bits.u & (0x7c00 << 13);
+	bits.u += (127-15) << 23;
+	if (exponent == 0x7c00 << 13) {
+		// infinity or NaN
+		bits.u += (128-16) << 23;
+	} else if (exponent == 0) {
+		// subnormal or zero
+		denormal.u = 113 << 23;
+		bits.u += 1 << 23;
+		bits.f -= denormal.f;
+	}
+	bits.u |= (half & 0x8000) << 16;
+	return bits.f;
+}
+
 // == alpha_shapes.cpp ==
 Mat alphaShapeFaces(const Mat points);
 Mat alphaShapeFaces(const Mat points, float *alpha); //'alpha' is currently just written to, not used
@@ -37,15 +77,38 @@ Mat alphaShapeFaces(const Mat points, float *alpha); //'alpha' is currently just
 Mesh poissonSurface(const Mat points, const Mat normals);
 
 // == flow.cpp ==
-Mat calculateFlow(const Mat prev, const Mat next, bool useFarneback);
+enum FlowMethod {FLOW_HORN_SCHUNCK, FLOW_FARNEBACK, FLOW_DIS};
+// calculates flow from one main image to any number of other images, preprocessing the main image just once
+class FlowContext {
+	public:
+		FlowContext(const Mat prev, FlowMethod method);
+		Mat calculate(const Mat next, float maxMotion=0) const; // packed flow with its variance, see floatToHalf()
+		std::vector<Mat> calculate(const std::vector<Mat> nexts, const std::vector<float> maxMotions=std::vector<float>()) const; // flow to each of the images, in parallel
+	protected:
+		Mat prev;
+		FlowMethod method;
+		std::vector<Mat> prevPyramid; // the main image repeatedly pyrDown'ed, as needed by the Horn-Schunck solver
+		std::vector<Mat> halfPyramid; // as needed by compare(), starting at half resolution, for the variance estimate
+		std::vector<Mat> gradX, gradY, coef; // derivatives of the main image, for the Horn-Schunck solver
+};
+Mat calculateFlow(const Mat prev, const Mat next, FlowMethod method);
+float maxFlowLength(const Mat flow);
 
 // == util.cpp ==
 Mat extractCameraCenter(const Mat camera);
-Mat triangulatePixels(const MatList flows, const Mat mainCamera, const MatList cameras, const Mat depth);
+Mat triangulatePixels(const MatList flows, const Mat mainCamera, const MatList cameras, const Mat depth, cv::Rect roi=cv::Rect(), int stride=1); // empty roi: whole image
+int pixelStride(const Mat depth, const Mat camera, const cv::Rect roi, float spacing);
 Mat compare(const Mat prev, const Mat next);
+Mat compare(const std::vector<Mat> &prevPyramid, const Mat next);
+std::vector<Mat> comparePyramid(const Mat image);
 Mat dehomogenize(Mat points);
 float sampleImage(const Mat image, float radius, const float x, const float y, char c);
 template <class T> T sampleImage(const Mat image, const float x, const float y); // linear sampling
+void packHalf(const float *src, uint16_t *dst, int count);
+void unpackHalf(const uint16_t *src, float *dst, int count);
+Mat unpackFlow(const Mat packed);
+cv::Rect foregroundBounds(const Mat depth, int margin);
+Mat uncrop(const Mat image, const cv::Rect roi, const cv::Size size);
 Mat mixBackground(const Mat image, const Mat background, Mat &depth);
 Mat flowRemap(const Mat flow, const Mat image);
 void saveImage(const Mat image, const char *fileName);
@@ -54,6 +117,45 @@ Mesh readMesh(const char *fileName);
 void saveMesh(const Mesh, const char *fileName);
 Mat imageGradient(const Mat image);
 
+// == bvh.cpp ==
+// bounding volume hierarchy over faces of a mesh, for ray casting on the CPU
+class MeshBVH {
+	public:
+		MeshBVH(const Mesh mesh);
+		bool occluded(const cv::Vec3f from, const cv::Vec3f to, float epsilon) const; // check if any face blocks the view between two points
+	protected:
+		typedef struct {
+			float vertex[3], edgeB[3], edgeC[3];
+		} Triangle;
+		typedef struct {
+			float lower[3], upper[3]; // bounding box
+			int offset, count; // leaf: range of triangles; inner node (count == 0): index of the right child
+		} Node;
+		int build(const std::vector<Triangle> &faces, const std::vector<cv::Vec3f> &centroids, std::vector<int> &order, int begin, int end, int depth);
+		std::vector<Node> nodes;
+		std::vector<Triangle> triangles;
+};
+
+// == pointcloud.cpp ==
+// rows of points stored in chunks of fixed size, to be appended to from several threads without copying what is already there
+class PointCloud {
+	public:
+		PointCloud(int columns);
+		~PointCloud();
+		void append(const Mat rows); // thread safe
+		int size() const;
+		Mat contiguous() const; // copy of all the rows, once the appending is done
+	protected:
+		static const int chunkRows = 1 << 16;
+		static const int maxChunks = 1 << 12;
+		int columns;
+		volatile int reserved; // rows taken by the appends so far
+		float *chunks[maxChunks]; // allocated on demand
+	private:
+		PointCloud(const PointCloud &);
+		PointCloud &operator=(const PointCloud &);
+};
+
 // == configuration.cpp ==
 class Configuration {
 	public:
@@ -63,14 +165,15 @@ class Configuration {
 		const Mat frame(int frameNo) const; // individual frames of the video clip
 		const Mat camera(int frameNo) const; // individual cameras
 		const std::vector<Mat> allCameras() const;
+		const std::vector<Mat> allFrames() const;
 		const float near(int frameNo); // near camera values for each frame
 		const float far(int frameNo);
 		const int frameCount();
 		int iterationCount;
 		char verbosity;
-		bool useFarneback; // switch between optflow algorithms by Farnebaeck and Horn&Schunck
+		FlowMethod flowMethod; // optical flow algorithm: Horn&Schunck, Farnebaeck or dense inverse search
 		float cameraThreshold; // thresholding value for camera selection
-		float sceneResolution; // a parameter to modify the density of the resulting mesh
+		float sceneResolution; // density of the triangulated points, as their count along the radius of point filtering; 0 for every pixel
 		float scalingFactor; // downsample each frame
 		unsigned skipFrames; // skip input frames, for testing
 		int width, height;
@@ -89,15 +192,43 @@ class Configuration {
 		bool doEstimateExposure;
 };
 
-// == render_glx.cpp (or perhaps render_<whatever>.cpp in the future) ==
+// == render_glx.cpp or render_soft.cpp, as selected by SYSTEM_OPENGL in the Makefile ==
+class Render;
+// Handle to an image that is still being rendered; get() waits for it and returns the result (just once)
+class RenderFuture {
+	public:
+		RenderFuture(): render(NULL), slot(-1) {};
+		RenderFuture(Render *render, int slot): render(render), slot(slot) {};
+		Mat get();
+		bool valid() const { return render != NULL; }
+	protected:
+		Render *render;
+		int slot;
+};
 class Render {
 	public:
 		virtual ~Render() {};
 		virtual void loadMesh(const Mesh) = 0;
+		virtual void loadFrames(const std::vector<Mat> frames) = 0; // remember the video clip, so that projected() can refer to frames by their number
 		virtual Mat projected(const Mat camera, const Mat frame, const Mat projector) = 0;
+		virtual Mat projected(const Mat camera, int frameNo, const Mat projector) = 0;
 		virtual Mat depth(const Mat camera) = 0;
+		virtual std::vector<Mat> depthBatch(const std::vector<Mat> cameras) = 0; // same as depth() for each camera, but faster
+		// start the rendering and return immediately; at most readbackSlots of these can be pending at once
+		virtual RenderFuture projectedAsync(const Mat camera, int frameNo, const Mat projector) = 0;
+		virtual RenderFuture depthAsync(const Mat camera) = 0;
+		virtual Mat fetch(int slot) = 0; // wait for a pending rendering; use RenderFuture::get() instead
+		static const int readbackSlots = 3;
 };
+inline Mat RenderFuture::get()
+{
+	assert(render);
+	Mat result = render->fetch(slot);
+	render = NULL;
+	return result;
+}
 Render *spawnRender(Heuristic hint);
+Render *spawnRender(cv::Size size);
 
 // == heuristic.cpp ==
 typedef std::pair <int, std::vector <int> > numberedVector;
@@ -113,12 +244,15 @@ class Heuristic {
 		void filterPoints(Mat& points, Mat& normals);
 		Mesh tessellate(const Mat points, const Mat normals);
 		cv::Size renderSize();
+		float pointSpacing(); // desired distance of neighboring triangulated points in the scene, 0 for no limit
 		static const int sentinel = -1;
 	protected:
+		float filterRadius();
 		Configuration *config;
 		int iteration;
 		int mainIdx, sideIdx;
 		std::vector <numberedVector> chosenCameras;
 		std::vector <float> alphaVals;
+		std::vector <cv::Vec3f> cameraCenters; // centers of all cameras, for visibility tests in chooseCameras
 };
 #endif
@@ -4,6 +4,9 @@
 #include <X11/Xutil.h>
 #include <GL/glew.h>
 #include <GL/glx.h>
+#include <list>
+#include <algorithm>
+#include <opencv2/imgproc/imgproc.hpp>
 
 //sets the variables vertexShaderSources, fragmentShaderSources
 #include "shaders.hpp"
@@ -18,9 +21,21 @@
 	#include <opencv2/core/core.hpp>
 	#include <opencv2/highgui/highgui.hpp>
 	#include <opencv2/imgproc/imgproc.hpp>
+	#define IMIN(a,b) (((a)<(b)) ? (a) : (b))
+	#define IMAX(a,b) (((a)>(b)) ? (a) : (b))
 	typedef cv::Mat Mat;
-	class Render {};
-	class Heuristic {public: cv::Size renderSize(){return cv::Size(0,0);};};
+	class Render;
+	class RenderFuture {
+		public:
+			RenderFuture(): render(NULL), slot(-1) {};
+			RenderFuture(Render *render, int slot): render(render), slot(slot) {};
+			Mat get();
+		protected:
+			Render *render;
+			int slot;
+	};
+	class Render {public: static const int readbackSlots = 3; virtual Mat fetch(int slot) = 0;};
+	Mat RenderFuture::get() {return render->fetch(slot);}
 	typedef struct Mesh{
 		Mat vertices, faces;
 		Mesh(Mat v, Mat f):vertices(v), faces(f) {};} Mesh;
@@ -28,6 +43,12 @@
 	#include "recon.hpp"
 #endif
 
+// maximal number of cached shadow maps; a side camera is usually reused by several neighbouring main cameras
+const int shadowCacheSize = 16;
+
+// maximal width and height of the depth atlas used for batch rendering, to keep its memory reasonable
+const int maxAtlasSize = 4096;
+
 // pointer to a function that can create an OpenGL 3.0 context
 typedef GLXContext (*GLXCREATECONTEXTATTRIBSARBPROC)(Display*, GLXFBConfig, GLXContext, Bool, const int*);
 
@@ -39,27 +60,62 @@ class RenderGLX: public Render {
 		RenderGLX(int width, int height, char *displayName);
 		~RenderGLX();
 		virtual void loadMesh(const Mesh mesh);
+		virtual void loadFrames(const std::vector<Mat> frames);
 		virtual Mat projected(const Mat camera, const Mat frame, const Mat projector);
+		virtual Mat projected(const Mat camera, int frameNo, const Mat projector);
 		virtual Mat depth(const Mat camera);
+		virtual std::vector<Mat> depthBatch(const std::vector<Mat> cameras);
+		virtual RenderFuture projectedAsync(const Mat camera, int frameNo, const Mat projector);
+		virtual RenderFuture depthAsync(const Mat camera);
+		virtual Mat fetch(int slot);
 	protected:
+		RenderFuture projectTexture(const Mat camera, GLuint texture, const Mat projector);
+		RenderFuture startReadback(GLenum format, GLenum type, int matType);
+		GLuint shadowMap(const Mat projector);
+		void clearShadowMaps();
+		void createAtlas();
 		static int instanceCount;
-		GLuint programID, mainMatrixID, sideMatrixID, textureSamplerID, shadowSamplerID, vertexbuffer, vertexArrayID, imgw, imgh;
+		GLuint programID, mainMatrixID, sideMatrixID, textureSamplerID, shadowSamplerID, vertexbuffer, elementbuffer, vertexArrayID, imgw, imgh;
 		Display *display;
 		GLXContext context;
 		GLXPbuffer glxbuffer;
-		int vertex_count;
+		int index_count;
+		GLsizeiptr vertexCapacity, elementCapacity; // allocated size of each buffer, in bytes
+		GLuint atlasFramebuffer, atlasTexture; // off-screen depth buffer for depthBatch, or 0 if not created yet
+		GLuint shadowFramebuffer; // off-screen framebuffer the shadow maps are rendered into, or 0 if not created yet
+		int atlasCols, atlasRows; // number of views that fit into the atlas horizontally and vertically
+		std::vector<Mat> frames; // the video clip, as supplied by loadFrames
+		std::vector<GLuint> frameTextures; // texture of each frame, or 0 if not uploaded yet
+		GLuint readbackBuffers[readbackSlots]; // pixel buffer objects that receive the rendered images asynchronously
+		int readbackTypes[readbackSlots]; // OpenCV type of the image pending in each buffer, or -1 if the buffer is free
+		int nextReadback; // buffer to be used by the next asynchronous rendering
+		typedef struct {
+			int generation; // value of meshGeneration when the shadow map was rendered
+			cv::Matx44f projector;
+			GLuint texture;
+		} ShadowMap;
+		std::list<ShadowMap> shadowMaps; // cached shadow maps, the most recently used first
+		int meshGeneration; // number of meshes loaded so far
 };
 // To solve some uncomfortable interference, some resources are freed just at the end of the program
 int RenderGLX::instanceCount = 0;
 
 // A generic function to create a Render instance; if this cpp file is used, it will be a RenderGLX instance
-Render *spawnRender(Heuristic hint)
+Render *spawnRender(cv::Size size)
 {
-	cv::Size size = hint.renderSize();
 	RenderGLX *render = new RenderGLX(size.width, size.height, getenv("DISPLAY"));
 	return render;
 }
 
+// Camera matrix with the y axis flipped, so that the rendered rows come out top-down, the same as OpenCV stores them
+Mat flipVertically(const Mat camera)
+{
+	Mat result = camera.clone();
+	Mat row = result.row(1);
+	row *= -1;
+	return result;
+}
+
 // Load a given grayscale image into OpenGL
 GLuint createTexture(const Mat image){
 	assert(image.channels() == 1);
@@ -152,8 +208,11 @@ RenderGLX::RenderGLX(int width, int height, char *displayName)
 {
 	instanceCount += 1;
 	
-	vertexbuffer = -1;
-	vertex_count = 0;
+	index_count = 0;
+	vertexCapacity = elementCapacity = 0;
+	atlasFramebuffer = atlasTexture = 0;
+	shadowFramebuffer = 0;
+	meshGeneration = 0;
 	
 	imgw = width;
 	imgh = height;
@@ -194,6 +253,9 @@ RenderGLX::RenderGLX(int width, int height, char *displayName)
 	glClearColor(0,0,0,0);
 	glEnable(GL_DEPTH_TEST);
 	glDepthFunc(GL_LESS); 
+	// image rows are tightly packed, whatever their width
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
 
 	// Load the vertex and fragment shader, and remember path to their parameters
 	programID = LoadShaders();
@@ -202,8 +264,21 @@ RenderGLX::RenderGLX(int width, int height, char *displayName)
 	shadowSamplerID = glGetUniformLocation(programID, "shadowSampler");
 	textureSamplerID = glGetUniformLocation(programID, "textureSampler");
 
-	// prepare an empty Vertex Buffer Object
+	// prepare an empty Vertex Array Object, along with its vertex and index buffers
 	glGenVertexArrays(1, &vertexArrayID);
+	glBindVertexArray(vertexArrayID);
+	glGenBuffers(1, &vertexbuffer);
+	glGenBuffers(1, &elementbuffer);
+
+	// prepare the pixel buffers for asynchronous readback, each large enough for a depth map
+	glGenBuffers(readbackSlots, readbackBuffers);
+	for (int i=0; i < readbackSlots; i++) {
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, readbackBuffers[i]);
+		glBufferData(GL_PIXEL_PACK_BUFFER, imgw * imgh * sizeof(float), NULL, GL_STREAM_READ);
+		readbackTypes[i] = -1;
+	}
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	nextReadback = 0;
 }
 
 RenderGLX::~RenderGLX()
@@ -211,10 +286,24 @@ RenderGLX::~RenderGLX()
 	instanceCount -= 1;
 	
 	// these buffers seem to interfere, may be caused by some optimization
-	if (vertexbuffer != -1 && instanceCount == 0)
+	if (instanceCount == 0) {
 		glDeleteBuffers(1, &vertexbuffer);
+		glDeleteBuffers(1, &elementbuffer);
+	}
 
 	// Deallocate resources
+	for (int i=0; i < frameTextures.size(); i++) {
+		if (frameTextures[i])
+			glDeleteTextures(1, &frameTextures[i]);
+	}
+	if (atlasFramebuffer) {
+		glDeleteFramebuffers(1, &atlasFramebuffer);
+		glDeleteTextures(1, &atlasTexture);
+	}
+	glDeleteBuffers(readbackSlots, readbackBuffers);
+	clearShadowMaps();
+	if (shadowFramebuffer)
+		glDeleteFramebuffers(1, &shadowFramebuffer);
 	glDeleteProgram(programID);
 	glDeleteVertexArrays(1, &vertexArrayID);
 	glXDestroyContext(display, context);
@@ -225,117 +314,87 @@ RenderGLX::~RenderGLX()
 		XCloseDisplay(display);
 }
 
+// Upload data into the given buffer object, reusing its storage if it is large enough
+void uploadBuffer(GLenum target, GLuint buffer, GLsizeiptr &capacity, const Mat data)
+{
+	GLsizeiptr size = data.total() * data.elemSize();
+	glBindBuffer(target, buffer);
+	if (size > capacity) {
+		glBufferData(target, size, data.data, GL_DYNAMIC_DRAW);
+		capacity = size;
+	} else {
+		glBufferSubData(target, 0, size, data.data);
+	}
+}
+
 // loads given Mesh structure into the OpenGL Vertex Buffer Object for rendering
 void RenderGLX::loadMesh(const Mesh mesh) {
 	assert (mesh.vertices.isContinuous() && mesh.faces.isContinuous());
+	assert (mesh.vertices.type() == CV_32FC1 && mesh.vertices.cols == 4 && mesh.faces.type() == CV_32SC1);
 
-	// the structure is just a list of triplets of vertices, each denoting a single face
-	// vertices are repeated as necessary
-	int face_count = mesh.faces.rows;
-	vertex_count = face_count*3;
-	GLfloat *vertex_buffer_data = new GLfloat[3*vertex_count];
-	for (int i=0; i < face_count; i++) {
-		const int32_t *face = mesh.faces.ptr<int32_t>(i);
-		for (int j=0; j < 3; j++) {
-			const float *point = mesh.vertices.ptr<float>(face[j]);
-			vertex_buffer_data[3*(3*i+j)+0] = point[0]/point[3];
-			vertex_buffer_data[3*(3*i+j)+1] = point[1]/point[3];
-			vertex_buffer_data[3*(3*i+j)+2] = point[2]/point[3];
-		}
-	}
-	
-	// Set this vertex buffer to be used during rendering
+	// vertices are stored just once, homogeneous (the vertex shader dehomogenizes them)
+	// and each face is a triplet of indices into them
 	glBindVertexArray(vertexArrayID);
-	if (vertexbuffer != -1)
-		glDeleteBuffers(1, &vertexbuffer);
-	glGenBuffers(1, &vertexbuffer);
-	glBindBuffer(GL_ARRAY_BUFFER, vertexbuffer);
-	
-	// Load the vertex positions into the GPU memory
-	glBufferData(GL_ARRAY_BUFFER, 3*vertex_count*sizeof(GLfloat), vertex_buffer_data, GL_STATIC_DRAW);
-	delete vertex_buffer_data;
+	// shadow maps of the previous mesh are no longer valid
+	clearShadowMaps();
+	meshGeneration++;
+	uploadBuffer(GL_ARRAY_BUFFER, vertexbuffer, vertexCapacity, mesh.vertices);
+	uploadBuffer(GL_ELEMENT_ARRAY_BUFFER, elementbuffer, elementCapacity, mesh.faces);
+	index_count = 3 * mesh.faces.rows;
+
+	// the Vertex Array Object remembers this setting for all subsequent draw calls
+	glEnableVertexAttribArray(0);
+	glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, 0, (void*)0);
+}
+
+// remembers the video clip; each frame gets uploaded to the GPU once, when it is projected for the first time
+void RenderGLX::loadFrames(const std::vector<Mat> clip)
+{
+	for (int i=0; i < frameTextures.size(); i++) {
+		if (frameTextures[i])
+			glDeleteTextures(1, &frameTextures[i]);
+	}
+	frames = clip;
+	frameTextures.assign(frames.size(), 0);
 }
 
 // Renders the (previously loaded) scene from the given (main) camera, with frame being projected from projector (aka. side camera)
 Mat RenderGLX::projected(const Mat camera, const Mat frame, const Mat projector)
 {
-	glUseProgram(programID);
+	GLuint texture = createTexture(frame);
+	Mat result = projectTexture(camera, texture, projector).get();
+	glDeleteTextures(1, &texture);
+	return result;
+}
 
-	glUniformMatrix4fv(mainMatrixID, 1, GL_TRUE, (float*)projector.data);
-	glUniformMatrix4fv(sideMatrixID, 1, GL_TRUE, (float*)projector.data);
+// Renders the scene with a frame of the video clip (as supplied by loadFrames) projected from projector
+// the texture is cached, so that it is not uploaded again for each main camera
+Mat RenderGLX::projected(const Mat camera, int frameNo, const Mat projector)
+{
+	return projectedAsync(camera, frameNo, projector).get();
+}
 
-	glEnableVertexAttribArray(0);
-	glBindBuffer(GL_ARRAY_BUFFER, vertexbuffer);
-	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, (void*)0);
+// Same as projected(), but the result is read back in the background while the caller can do something else
+RenderFuture RenderGLX::projectedAsync(const Mat camera, int frameNo, const Mat projector)
+{
+	if (!frameTextures[frameNo])
+		frameTextures[frameNo] = createTexture(frames[frameNo]);
+	return projectTexture(camera, frameTextures[frameNo], projector);
+}
 
-	// == BEGIN generate a shadow map ==
-	Mat shadow(imgh, imgw, CV_32FC1);
-	GLuint shadowMapTexture;
-	{
-		glClear(GL_DEPTH_BUFFER_BIT);
-		
-		// Render the scene without setting any texture or projector
-		glViewport(0, 0, imgw, imgh);
-		glDrawArrays(GL_TRIANGLES, 0, vertex_count);
-		
-		glDisableVertexAttribArray(0);
-		glDisableVertexAttribArray(1);
-	
-		// Read the depth data into the matrix (flipping not necessary as we read them back later)
-		glReadPixels(0, 0, imgw, imgh, GL_DEPTH_COMPONENT, GL_FLOAT, shadow.data);
-		{
-			// apply a size 1 dilation filter to reduce shadow acne
-			float *prevRowHF = new float[shadow.cols]; // values on the previous row after horizontal filtering
-			float *curRow = shadow.ptr<float>(0), *prevRow; // current and previous row of the image, respectively
-			float prevVal = curRow[0]; // value of the pixel to the left, before filtering
-			for (int j=1; j<shadow.cols-1; j++) {
-				prevRowHF[j] = curRow[j];
-				if (curRow[j-1] < prevRowHF[j]) prevRowHF[j] = curRow[j-1];
-				if (curRow[j+1] < prevRowHF[j]) prevRowHF[j] = curRow[j+1];
-				curRow[j] = prevRowHF[j];
-			}
-			for (int i=1; i<shadow.rows; i++) {
-				prevRow = curRow;
-				curRow = shadow.ptr<float>(i);
-				float prevVal = curRow[0];
-				for (int j=1; j<shadow.cols-1; j++) {
-					float val = curRow[j];
-					if (prevVal > curRow[j]) curRow[j] = prevVal;
-					if (curRow[j+1] > curRow[j]) curRow[j] = curRow[j+1];
-					float valHF = curRow[j];
-					if (prevRowHF[j] > curRow[j]) curRow[j] = prevRowHF[j];
-					if (curRow[j] > prevRow[j]) prevRow[j] = curRow[j];
-					prevRowHF[j] = valHF;
-					prevVal = val;
-				}
-			}
-			delete prevRowHF;
-		}
-	
-		// set shadow map parameters
-		glGenTextures(1, &shadowMapTexture);
-		glBindTexture(GL_TEXTURE_2D, shadowMapTexture);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST); // magnifying filter: nearest neighbor
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST); // minifying filter: neares neighbor
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-		
-		// load the shadow map back into GPU
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT, imgw, imgh, 0, GL_DEPTH_COMPONENT, GL_FLOAT, shadow.data);
-
-		glBindTexture(GL_TEXTURE_2D, 0);
-	}
-	// == END generate a shadow map ==
+// Renders the scene from the given (main) camera, with the texture being projected from projector
+RenderFuture RenderGLX::projectTexture(const Mat camera, GLuint texture, const Mat projector)
+{
+	glUseProgram(programID);
 
-	// again, set all necessary scene parameters
-	glEnableVertexAttribArray(0);
-	glBindBuffer(GL_ARRAY_BUFFER, vertexbuffer);
-	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, (void*)0);
+	glUniformMatrix4fv(sideMatrixID, 1, GL_TRUE, (float*)projector.data);
+	GLuint shadowMapTexture = shadowMap(projector);
 
+	// set all necessary scene parameters
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-	glUniformMatrix4fv(mainMatrixID, 1, GL_TRUE, (float*)camera.data);
-	GLuint texture = createTexture(frame);
+	Mat flippedCamera = flipVertically(camera);
+	glUniformMatrix4fv(mainMatrixID, 1, GL_TRUE, (float*)flippedCamera.data);
 	glActiveTexture(GL_TEXTURE0);
 	glBindTexture(GL_TEXTURE_2D, texture);
 	glActiveTexture(GL_TEXTURE1);
@@ -346,58 +405,215 @@ Mat RenderGLX::projected(const Mat camera, const Mat frame, const Mat projector)
 
 	// Render the scene
 	glViewport(0, 0, imgw, imgh);
-	glDrawArrays(GL_TRIANGLES, 0, vertex_count);
+	glDrawElements(GL_TRIANGLES, index_count, GL_UNSIGNED_INT, (void*)0);
 
-	glDisableVertexAttribArray(0);
-	glDisableVertexAttribArray(1);
-
-	// Read off rendered image to the matrix
-	Mat result(imgh, imgw, CV_8UC3);
+	// Start reading off the rendered image; it is already flipped top-down by the camera matrix
 	glReadBuffer(GL_FRONT);
 	// although it is a RGB, only the red channel is the actual data; G, B are the mask
-	glReadPixels(0, 0, imgw, imgh, GL_RGB, GL_UNSIGNED_BYTE, result.data);
-	
-	glDeleteTextures(1, &texture);
-	glDeleteTextures(1, &shadowMapTexture);
-	
-	// Flip the result top-down before returning
-	cv::flip(result, result, 0);
-	return result;
-}	
+	return startReadback(GL_RGB, GL_UNSIGNED_BYTE, CV_8UC3);
+}
+
+// Returns a shadow map texture for the given projector, rendering it only if it is not cached yet
+// the depth is rendered directly into the texture and never leaves the GPU (the dilation is left to the fragment shader)
+GLuint RenderGLX::shadowMap(const Mat projector)
+{
+	cv::Matx44f key(projector);
+	for (std::list<ShadowMap>::iterator it = shadowMaps.begin(); it != shadowMaps.end(); it++) {
+		if (it->generation == meshGeneration && std::equal(key.val, key.val + 16, it->projector.val)) {
+			// move it to the front, as the most recently used one
+			shadowMaps.splice(shadowMaps.begin(), shadowMaps, it);
+			return it->texture;
+		}
+	}
+
+	// set shadow map parameters
+	GLuint texture;
+	glGenTextures(1, &texture);
+	glBindTexture(GL_TEXTURE_2D, texture);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST); // magnifying filter: nearest neighbor
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST); // minifying filter: neares neighbor
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, imgw, imgh, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
+	// unbind it, so that it is not sampled while being rendered into
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	if (!shadowFramebuffer) {
+		glGenFramebuffers(1, &shadowFramebuffer);
+		glBindFramebuffer(GL_FRAMEBUFFER, shadowFramebuffer);
+		// there is no color attachment, we only need the depth
+		glDrawBuffer(GL_NONE);
+		glReadBuffer(GL_NONE);
+	}
+	glBindFramebuffer(GL_FRAMEBUFFER, shadowFramebuffer);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, texture, 0);
+
+	// Render the scene from the projector without setting any texture (flipping not necessary as the shader samples it the same way)
+	glClear(GL_DEPTH_BUFFER_BIT);
+	glUniformMatrix4fv(mainMatrixID, 1, GL_TRUE, (float*)projector.data);
+	glViewport(0, 0, imgw, imgh);
+	glDrawElements(GL_TRIANGLES, index_count, GL_UNSIGNED_INT, (void*)0);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+	// remember it, forgetting the least recently used one if the cache is full
+	if (shadowMaps.size() >= shadowCacheSize) {
+		glDeleteTextures(1, &shadowMaps.back().texture);
+		shadowMaps.pop_back();
+	}
+	ShadowMap cached = {meshGeneration, key, texture};
+	shadowMaps.push_front(cached);
+	return texture;
+}
+
+// Forget all cached shadow maps
+void RenderGLX::clearShadowMaps()
+{
+	for (std::list<ShadowMap>::iterator it = shadowMaps.begin(); it != shadowMaps.end(); it++)
+		glDeleteTextures(1, &it->texture);
+	shadowMaps.clear();
+}
 
 Mat RenderGLX::depth(const Mat camera) {
+	return depthAsync(camera).get();
+}
+
+// Same as depth(), but the result is read back in the background while the caller can do something else
+RenderFuture RenderGLX::depthAsync(const Mat camera) {
 	glClear(GL_DEPTH_BUFFER_BIT);
 
 	// render without using any texture nor projector
 	glUseProgram(programID);
 
-	glUniformMatrix4fv(mainMatrixID, 1, GL_TRUE, (float*)camera.data);
-
-	glEnableVertexAttribArray(0);
-	glBindBuffer(GL_ARRAY_BUFFER, vertexbuffer);
-	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, (void*)0);
+	Mat flippedCamera = flipVertically(camera);
+	glUniformMatrix4fv(mainMatrixID, 1, GL_TRUE, (float*)flippedCamera.data);
 
 	// render the scene
 	glViewport(0, 0, imgw, imgh);
-	glDrawArrays(GL_TRIANGLES, 0, vertex_count);
+	glDrawElements(GL_TRIANGLES, index_count, GL_UNSIGNED_INT, (void*)0);
 
-	glDisableVertexAttribArray(0);
-	glDisableVertexAttribArray(1);
-
-	// read off depth data
-	Mat result(imgh, imgw, CV_32FC1);
+	// start reading off depth data
 	glReadBuffer(GL_DEPTH_ATTACHMENT);
-	glReadPixels(0, 0, imgw, imgh, GL_DEPTH_COMPONENT, GL_FLOAT, result.data);
-	cv::flip(result, result, 0);
+	return startReadback(GL_DEPTH_COMPONENT, GL_FLOAT, CV_32FC1);
+}
+
+// Start copying the rendered image into the next pixel buffer; the copy runs on the GPU, without waiting for the rendering to finish
+RenderFuture RenderGLX::startReadback(GLenum format, GLenum type, int matType)
+{
+	int slot = nextReadback;
+	assert(readbackTypes[slot] == -1); // too many renderings pending
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, readbackBuffers[slot]);
+	glReadPixels(0, 0, imgw, imgh, format, type, (void*)0);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	glFlush();
+
+	readbackTypes[slot] = matType;
+	nextReadback = (nextReadback + 1) % readbackSlots;
+	return RenderFuture(this, slot);
+}
 
-	// remap the values linearly to get actual depth map values
-	result = 2*result - 1;
+// Wait until the given pixel buffer is filled and copy its contents into a matrix
+Mat RenderGLX::fetch(int slot)
+{
+	assert(readbackTypes[slot] != -1);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, readbackBuffers[slot]);
+	Mat mapped(imgh, imgw, readbackTypes[slot], glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY));
+	Mat result;
+	if (readbackTypes[slot] == CV_32FC1) {
+		// remap the values linearly to get actual depth map values
+		result = 2*mapped - 1;
+	} else {
+		mapped.copyTo(result);
+	}
+	glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	readbackTypes[slot] = -1;
+	return result;
+}
+
+// Create an off-screen framebuffer with a depth texture large enough to hold several views side by side
+void RenderGLX::createAtlas()
+{
+	GLint maxTextureSize, maxViewport[2];
+	glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxTextureSize);
+	glGetIntegerv(GL_MAX_VIEWPORT_DIMS, maxViewport);
+	int maxWidth = IMIN(maxAtlasSize, IMIN(maxTextureSize, maxViewport[0])),
+	    maxHeight = IMIN(maxAtlasSize, IMIN(maxTextureSize, maxViewport[1]));
+	atlasCols = IMAX(1, maxWidth / (int)imgw);
+	atlasRows = IMAX(1, maxHeight / (int)imgh);
+
+	glGenTextures(1, &atlasTexture);
+	glBindTexture(GL_TEXTURE_2D, atlasTexture);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, atlasCols*imgw, atlasRows*imgh, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	glGenFramebuffers(1, &atlasFramebuffer);
+	glBindFramebuffer(GL_FRAMEBUFFER, atlasFramebuffer);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, atlasTexture, 0);
+	// there is no color attachment, we only need the depth
+	glDrawBuffer(GL_NONE);
+	glReadBuffer(GL_NONE);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+// Renders depth from each of the given cameras
+// the views are tiled into a single off-screen atlas, which is read back at once
+std::vector<Mat> RenderGLX::depthBatch(const std::vector<Mat> cameras)
+{
+	std::vector<Mat> result;
+	result.reserve(cameras.size());
+	if (!atlasFramebuffer)
+		createAtlas();
+	glBindFramebuffer(GL_FRAMEBUFFER, atlasFramebuffer);
+	glUseProgram(programID);
+
+	int atlasSize = atlasCols * atlasRows;
+	for (int begin=0; begin < cameras.size(); begin += atlasSize) {
+		int count = IMIN(atlasSize, (int)cameras.size() - begin),
+		    usedRows = (count + atlasCols - 1) / atlasCols;
+		glClear(GL_DEPTH_BUFFER_BIT);
+
+		// render each view into its own cell, starting from the bottom left
+		for (int i=0; i < count; i++) {
+			glViewport((i % atlasCols) * imgw, (i / atlasCols) * imgh, imgw, imgh);
+			glUniformMatrix4fv(mainMatrixID, 1, GL_TRUE, (float*)cameras[begin+i].data);
+			glDrawElements(GL_TRIANGLES, index_count, GL_UNSIGNED_INT, (void*)0);
+		}
+
+		// read off depth data of all the used cells
+		Mat atlas(usedRows * imgh, atlasCols * imgw, CV_32FC1);
+		glReadPixels(0, 0, atlas.cols, atlas.rows, GL_DEPTH_COMPONENT, GL_FLOAT, atlas.data);
+		cv::flip(atlas, atlas, 0);
+
+		// cut out the individual views and remap the values linearly to get actual depth map values
+		for (int i=0; i < count; i++) {
+			int row = usedRows - 1 - i / atlasCols, col = i % atlasCols;
+			Mat view = atlas(cv::Rect(col * imgw, row * imgh, imgw, imgh));
+			result.push_back(2*view - 1);
+		}
+	}
+
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	glViewport(0, 0, imgw, imgh);
 	return result;
 }
 
 #ifdef TEST_BUILD
+// Smooth synthetic texture for the golden images, so that the texture filtering of the backends differs as little as possible
+Mat goldenTexture(int width, int height)
+{
+	Mat texture(height, width, CV_8UC1);
+	for (int i=0; i<height; i++) {
+		for (int j=0; j<width; j++)
+			texture.at<uchar>(i, j) = cv::saturate_cast<uchar>(128 + 100 * sin(j / 20.) * cos(i / 20.));
+	}
+	return texture;
+}
+
 // Main function for testing of the shadows etc.
 // should output files 'depth.png' (black and white) and 'projected.png' (mostly yellow and black)
+// with the argument 'golden', writes the reference images test/golden-depth.png and test/golden-projected.png for test_soft instead
 // If this function does not run, this code is incompatible with your system
 int main(int argc, char ** argv)
 {
@@ -409,17 +625,29 @@ Mat MVP(cv::Matx44f(-1.195982575416565, 1.350219488143921, 1.237614393234253, 30
 Mat sideMVP(cv::Matx44f(-1.831691861152649, -1.1502554416656494, -0.3270684480667114, -11.764444351196289, 1.391772985458374, -2.4397428035736084, 0.7858548760414124, 19.515047073364258, 0.3260231614112854, -0.188545361161232, -1.1627495288848877, -21.932016372680664, 0.2667462229728699, -0.1542643904685974, -0.9513405561447144, -12.489831924438477));
 
 	r.loadMesh(Mesh(points, indices));
+	if (argc > 1 && std::string(argv[1]) == "golden") {
+		// depth is stored as (depth + 1) / 2 in 16 bits
+		Mat goldenDepth;
+		r.depth(MVP).convertTo(goldenDepth, CV_16UC1, 65535 / 2., 65535 / 2.);
+		cv::imwrite("test/golden-depth.png", goldenDepth);
+		cv::imwrite("test/golden-projected.png", r.projected(MVP, goldenTexture(640, 480), sideMVP));
+		return 0;
+	}
 	Mat tex = cv::imread("test/grid.png");
-	cv::cvtColor(tex, tex, CV_RGB2GRAY);
-	Mat frame = r.projected(MVP, tex, sideMVP);
-	for (int i=0; i<points.rows; i++) {
-		Mat point = points.row(i).t();
-		point = MVP * point;
-		float pointW = point.at<float>(3, 0), pointX = point.at<float>(0, 0)/pointW, pointY = point.at<float>(1, 0)/pointW, pointZ = point.at<float>(2, 0)/pointW;
-		cv::Scalar color = (pointZ <= 1 && pointZ >= -1) ? cv::Scalar(128*(1-pointZ), 128*(pointZ+1), 0) : cv::Scalar(0, 0, 255);
-		cv::circle(frame, cv::Point(frame.cols*(0.5 + pointX*0.5), frame.rows * (0.5 - pointY*0.5)), 3, color, -1, 8);
+	if (tex.empty()) {
+		std::cout << "Skipping 'projected.png': texture test/grid.png not found" << std::endl;
+	} else {
+		cv::cvtColor(tex, tex, CV_RGB2GRAY);
+		Mat frame = r.projected(MVP, tex, sideMVP);
+		for (int i=0; i<points.rows; i++) {
+			Mat point = points.row(i).t();
+			point = MVP * point;
+			float pointW = point.at<float>(3, 0), pointX = point.at<float>(0, 0)/pointW, pointY = point.at<float>(1, 0)/pointW, pointZ = point.at<float>(2, 0)/pointW;
+			cv::Scalar color = (pointZ <= 1 && pointZ >= -1) ? cv::Scalar(128*(1-pointZ), 128*(pointZ+1), 0) : cv::Scalar(0, 0, 255);
+			cv::circle(frame, cv::Point(frame.cols*(0.5 + pointX*0.5), frame.rows * (0.5 - pointY*0.5)), 3, color, -1, 8);
+		}
+		cv::imwrite("projected.png", frame);
 	}
-	cv::imwrite("projected.png", frame);
 	Mat depth = r.depth(MVP);
 	double min, max;
 	minMaxIdx(depth, &min, &max);
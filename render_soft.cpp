@@ -0,0 +1,581 @@
+// render_soft.cpp: software rasterizer, a replacement of render_glx.cpp for machines without X server or GPU
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <vector>
+#include <list>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#ifdef __SSE2__
+	#include <emmintrin.h>
+#endif
+
+#ifdef TEST_BUILD
+	#include <iostream>
+	#include <opencv2/highgui/highgui.hpp>
+	#define IMIN(a,b) (((a)<(b)) ? (a) : (b))
+	#define IMAX(a,b) (((a)>(b)) ? (a) : (b))
+	typedef cv::Mat Mat;
+	const float backgroundDepth = 1.0;
+	class Render;
+	class RenderFuture {
+		public:
+			RenderFuture(): render(NULL), slot(-1) {};
+			RenderFuture(Render *render, int slot): render(render), slot(slot) {};
+			Mat get();
+		protected:
+			Render *render;
+			int slot;
+	};
+	class Render {public: static const int readbackSlots = 3; virtual Mat fetch(int slot) = 0;};
+	Mat RenderFuture::get() {return render->fetch(slot);}
+	typedef struct Mesh{
+		Mat vertices, faces;
+		Mesh(Mat v, Mat f):vertices(v), faces(f) {};} Mesh;
+#else
+	#include "recon.hpp"
+#endif
+
+// size of a square screen tile rasterized by a single thread; must be a multiple of 4
+const int tileSize = 64;
+// tolerance of the shadow map visibility test, the same as in shader.frag
+const float shadowBias = 0.01;
+// maximal number of cached shadow maps, the same as in render_glx.cpp
+const int shadowCacheSize = 16;
+
+// A mesh face after projection and clipping, set up for rasterization
+typedef struct {
+	float bary[3][3]; // screen-space plane equations (a*x + b*y + c) of the three barycentric coordinates
+	float depth[3]; // plane equation of the normalized device depth
+	float invW[3]; // inverse homogeneous coordinate of each vertex, for perspective-correct interpolation
+	float pos[3][3]; // world-space position of each vertex
+	int minX, minY, maxX, maxY; // bounding box in pixels, inclusive
+} ScreenTriangle;
+
+// Specialization of the generic Render class
+class RenderSoft: public Render {
+	public:
+		RenderSoft(int width, int height);
+		virtual void loadMesh(const Mesh mesh);
+		virtual void loadFrames(const std::vector<Mat> frames);
+		virtual Mat projected(const Mat camera, const Mat frame, const Mat projector);
+		virtual Mat projected(const Mat camera, int frameNo, const Mat projector);
+		virtual Mat depth(const Mat camera);
+		virtual std::vector<Mat> depthBatch(const std::vector<Mat> cameras);
+		virtual RenderFuture projectedAsync(const Mat camera, int frameNo, const Mat projector);
+		virtual RenderFuture depthAsync(const Mat camera);
+		virtual Mat fetch(int slot);
+	protected:
+		RenderFuture finished(const Mat result);
+		Mat shadowMap(const Mat projector);
+		void rasterize(const Mat camera, Mat &depth, Mat &ids);
+		int imgw, imgh;
+		Mat vertices, faces; // Cartesian vertex positions in rows, vertex indices of each face in rows
+		std::vector<Mat> frames; // the video clip, as supplied by loadFrames
+		std::vector<ScreenTriangle> triangles; // setup of the most recently rasterized view
+		Mat readbacks[readbackSlots]; // results of the "asynchronous" renderings not fetched yet
+		int nextReadback;
+		typedef struct {
+			int generation; // value of meshGeneration when the shadow map was rendered
+			cv::Matx44f projector;
+			Mat depth;
+		} ShadowMap;
+		std::list<ShadowMap> shadowMaps; // cached shadow maps, the most recently used first
+		int meshGeneration; // number of meshes loaded so far
+};
+
+// A generic function to create a Render instance; if this cpp file is used, it will be a RenderSoft instance
+Render *spawnRender(cv::Size size)
+{
+	RenderSoft *render = new RenderSoft(size.width, size.height);
+	return render;
+}
+
+RenderSoft::RenderSoft(int width, int height)
+{
+	imgw = width;
+	imgh = height;
+	nextReadback = 0;
+	meshGeneration = 0;
+}
+
+// stores a copy of the given Mesh, dehomogenized
+void RenderSoft::loadMesh(const Mesh mesh)
+{
+	assert (mesh.vertices.isContinuous() && mesh.faces.isContinuous());
+	vertices = Mat(mesh.vertices.rows, 3, CV_32FC1);
+	for (int i=0; i < mesh.vertices.rows; i++) {
+		const float *point = mesh.vertices.ptr<float>(i);
+		float *out = vertices.ptr<float>(i);
+		out[0] = point[0]/point[3];
+		out[1] = point[1]/point[3];
+		out[2] = point[2]/point[3];
+	}
+	mesh.faces.copyTo(faces);
+
+	// shadow maps of the previous mesh are no longer valid
+	shadowMaps.clear();
+	meshGeneration++;
+}
+
+// remembers the video clip; the frames are not copied
+void RenderSoft::loadFrames(const std::vector<Mat> clip)
+{
+	frames = clip;
+}
+
+// Transforms all vertices to clip space, in parallel
+class VertexTransform: public cv::ParallelLoopBody {
+	public:
+		VertexTransform(const Mat vertices, const cv::Matx44f camera, Mat &clip): vertices(vertices), camera(camera), clip(clip) {};
+		virtual void operator()(const cv::Range &range) const {
+			for (int i=range.start; i < range.end; i++) {
+				const float *p = vertices.ptr<float>(i);
+				float *out = clip.ptr<float>(i);
+				for (int j=0; j < 4; j++)
+					out[j] = camera(j,0)*p[0] + camera(j,1)*p[1] + camera(j,2)*p[2] + camera(j,3);
+			}
+		}
+	protected:
+		const Mat vertices;
+		const cv::Matx44f camera;
+		Mat &clip;
+};
+
+// a vertex in homogeneous clip space, along with its world-space position
+typedef struct {
+	float clip[4], pos[3];
+} ClipVertex;
+
+// Set up a single screen-space triangle; returns false if it does not cover any pixel center
+bool setupTriangle(const ClipVertex *v, int width, int height, ScreenTriangle &t)
+{
+	float x[3], y[3], z[3];
+	for (int i=0; i<3; i++) {
+		if (v[i].clip[3] <= 0)
+			return false;
+		t.invW[i] = 1 / v[i].clip[3];
+		// from normalized device coordinates to pixels, with rows going top-down (as OpenCV stores images)
+		x[i] = (v[i].clip[0] * t.invW[i] + 1) * 0.5 * width;
+		y[i] = (1 - v[i].clip[1] * t.invW[i]) * 0.5 * height;
+		z[i] = v[i].clip[2] * t.invW[i];
+		for (int j=0; j<3; j++)
+			t.pos[i][j] = v[i].pos[j];
+	}
+	// doubled signed area; both orientations are rendered, as GL_CULL_FACE is not used either
+	float area = (x[1]-x[0])*(y[2]-y[0]) - (x[2]-x[0])*(y[1]-y[0]);
+	if (area == 0)
+		return false;
+
+	// pixel centers are at half-integer coordinates
+	t.minX = IMAX(0, (int)ceil(IMIN(x[0], IMIN(x[1], x[2])) - 0.5));
+	t.minY = IMAX(0, (int)ceil(IMIN(y[0], IMIN(y[1], y[2])) - 0.5));
+	t.maxX = IMIN(width-1, (int)floor(IMAX(x[0], IMAX(x[1], x[2])) - 0.5));
+	t.maxY = IMIN(height-1, (int)floor(IMAX(y[0], IMAX(y[1], y[2])) - 0.5));
+	if (t.minX > t.maxX || t.minY > t.maxY)
+		return false;
+
+	// barycentric coordinate of vertex i is the edge function of the opposite edge, divided by the area
+	for (int i=0; i<3; i++) {
+		int a = (i+1)%3, b = (i+2)%3;
+		t.bary[i][0] = (y[a] - y[b]) / area;
+		t.bary[i][1] = (x[b] - x[a]) / area;
+		t.bary[i][2] = (x[a]*y[b] - x[b]*y[a]) / area;
+	}
+	// depth is affine in screen space
+	for (int j=0; j<3; j++)
+		t.depth[j] = t.bary[0][j]*z[0] + t.bary[1][j]*z[1] + t.bary[2][j]*z[2];
+	return true;
+}
+
+// Rasterizes all triangles binned into each tile, in parallel over tiles
+// each tile is processed by a single thread, so no synchronization is needed
+class TileRasterizer: public cv::ParallelLoopBody {
+	public:
+		TileRasterizer(const std::vector<ScreenTriangle> &triangles, const std::vector< std::vector<int> > &bins, int tileCols, Mat &depth, Mat &ids):
+			triangles(triangles), bins(bins), tileCols(tileCols), depth(depth), ids(ids) {};
+		virtual void operator()(const cv::Range &range) const {
+			float tileDepth[tileSize*tileSize];
+			int32_t tileIds[tileSize*tileSize];
+			for (int tile=range.start; tile < range.end; tile++) {
+				int originX = (tile % tileCols) * tileSize, originY = (tile / tileCols) * tileSize;
+				int endX = IMIN(originX + tileSize, depth.cols), endY = IMIN(originY + tileSize, depth.rows);
+				for (int i=0; i < tileSize*tileSize; i++) {
+					tileDepth[i] = backgroundDepth;
+					tileIds[i] = -1;
+				}
+				// triangles are stored in the order of mesh faces, so that depth ties are resolved the same way as in OpenGL
+				const std::vector<int> &bin = bins[tile];
+				for (int k=0; k < bin.size(); k++)
+					rasterizeTriangle(triangles[bin[k]], bin[k], originX, originY, endX, endY, tileDepth, tileIds);
+				// copy the results out
+				for (int y=originY; y < endY; y++) {
+					float *depthRow = depth.ptr<float>(y);
+					int32_t *idRow = ids.ptr<int32_t>(y);
+					for (int x=originX; x < endX; x++) {
+						depthRow[x] = tileDepth[(y-originY)*tileSize + x-originX];
+						idRow[x] = tileIds[(y-originY)*tileSize + x-originX];
+					}
+				}
+			}
+		}
+	protected:
+		void rasterizeTriangle(const ScreenTriangle &t, int32_t id, int originX, int originY, int endX, int endY, float *tileDepth, int32_t *tileIds) const {
+			int startX = IMAX(t.minX, originX), stopX = IMIN(t.maxX+1, endX),
+			    startY = IMAX(t.minY, originY), stopY = IMIN(t.maxY+1, endY);
+			if (startX >= stopX || startY >= stopY)
+				return;
+			#ifdef __SSE2__
+			// process four pixels at once; the tile buffer is wide enough to contain the whole aligned span
+			startX -= (startX - originX) % 4;
+			const __m128 offsets = _mm_set_ps(3.5, 2.5, 1.5, 0.5), four = _mm_set1_ps(4), zero = _mm_setzero_ps(),
+			             minDepth = _mm_set1_ps(-1), ba0 = _mm_set1_ps(t.bary[0][0]), ba1 = _mm_set1_ps(t.bary[1][0]),
+			             ba2 = _mm_set1_ps(t.bary[2][0]), da = _mm_set1_ps(t.depth[0]);
+			const __m128i vid = _mm_set1_epi32(id);
+			for (int y=startY; y < stopY; y++) {
+				float py = y + 0.5;
+				__m128 px = _mm_add_ps(_mm_set1_ps(startX), offsets),
+				       b0 = _mm_add_ps(_mm_mul_ps(ba0, px), _mm_set1_ps(t.bary[0][1]*py + t.bary[0][2])),
+				       b1 = _mm_add_ps(_mm_mul_ps(ba1, px), _mm_set1_ps(t.bary[1][1]*py + t.bary[1][2])),
+				       b2 = _mm_add_ps(_mm_mul_ps(ba2, px), _mm_set1_ps(t.bary[2][1]*py + t.bary[2][2])),
+				       z = _mm_add_ps(_mm_mul_ps(da, px), _mm_set1_ps(t.depth[1]*py + t.depth[2]));
+				const __m128 step0 = _mm_mul_ps(ba0, four), step1 = _mm_mul_ps(ba1, four), step2 = _mm_mul_ps(ba2, four), stepZ = _mm_mul_ps(da, four);
+				float *depthRow = tileDepth + (y-originY)*tileSize - originX;
+				int32_t *idRow = tileIds + (y-originY)*tileSize - originX;
+				for (int x=startX; x < stopX; x += 4) {
+					__m128 oldDepth = _mm_loadu_ps(depthRow + x);
+					// inside all three edges, closer than the current value and not in front of the near plane
+					__m128 mask = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(b0, zero), _mm_cmpge_ps(b1, zero)),
+					                         _mm_and_ps(_mm_cmpge_ps(b2, zero), _mm_and_ps(_mm_cmplt_ps(z, oldDepth), _mm_cmpge_ps(z, minDepth))));
+					_mm_storeu_ps(depthRow + x, _mm_or_ps(_mm_and_ps(mask, z), _mm_andnot_ps(mask, oldDepth)));
+					__m128i imask = _mm_castps_si128(mask), oldIds = _mm_loadu_si128((__m128i*)(idRow + x));
+					_mm_storeu_si128((__m128i*)(idRow + x), _mm_or_si128(_mm_and_si128(imask, vid), _mm_andnot_si128(imask, oldIds)));
+					b0 = _mm_add_ps(b0, step0);
+					b1 = _mm_add_ps(b1, step1);
+					b2 = _mm_add_ps(b2, step2);
+					z = _mm_add_ps(z, stepZ);
+				}
+			}
+			#else
+			for (int y=startY; y < stopY; y++) {
+				float py = y + 0.5;
+				float *depthRow = tileDepth + (y-originY)*tileSize - originX;
+				int32_t *idRow = tileIds + (y-originY)*tileSize - originX;
+				for (int x=startX; x < stopX; x++) {
+					float px = x + 0.5,
+					      b0 = t.bary[0][0]*px + t.bary[0][1]*py + t.bary[0][2],
+					      b1 = t.bary[1][0]*px + t.bary[1][1]*py + t.bary[1][2],
+					      b2 = t.bary[2][0]*px + t.bary[2][1]*py + t.bary[2][2],
+					      z = t.depth[0]*px + t.depth[1]*py + t.depth[2];
+					if (b0 >= 0 && b1 >= 0 && b2 >= 0 && z < depthRow[x] && z >= -1) {
+						depthRow[x] = z;
+						idRow[x] = id;
+					}
+				}
+			}
+			#endif
+		}
+		const std::vector<ScreenTriangle> &triangles;
+		const std::vector< std::vector<int> > &bins;
+		int tileCols;
+		Mat &depth, &ids;
+};
+
+// Renders the (previously loaded) scene from the given camera
+// depth: output normalized device depth of each pixel, backgroundDepth where empty
+// ids: output index into 'triangles' of the visible triangle at each pixel, -1 where empty
+void RenderSoft::rasterize(const Mat camera, Mat &depth, Mat &ids)
+{
+	// transform all vertices
+	Mat clip(vertices.rows, 4, CV_32FC1);
+	cv::parallel_for_(cv::Range(0, vertices.rows), VertexTransform(vertices, cv::Matx44f(camera), clip));
+
+	// clip all faces against the near plane and set up the resulting triangles
+	triangles.clear();
+	for (int i=0; i < faces.rows; i++) {
+		const int32_t *face = faces.ptr<int32_t>(i);
+		ClipVertex v[3];
+		float distance[3]; // signed distance from the near plane, z + w >= 0 is inside
+		int insideCount = 0;
+		for (int j=0; j<3; j++) {
+			memcpy(v[j].clip, clip.ptr<float>(face[j]), 4*sizeof(float));
+			memcpy(v[j].pos, vertices.ptr<float>(face[j]), 3*sizeof(float));
+			distance[j] = v[j].clip[2] + v[j].clip[3];
+			insideCount += (distance[j] >= 0);
+		}
+		// cull faces completely outside of the side planes of the view volume
+		bool outside = false;
+		for (int axis=0; axis<2 && !outside; axis++) {
+			outside = (v[0].clip[axis] > v[0].clip[3] && v[1].clip[axis] > v[1].clip[3] && v[2].clip[axis] > v[2].clip[3]) ||
+			          (v[0].clip[axis] < -v[0].clip[3] && v[1].clip[axis] < -v[1].clip[3] && v[2].clip[axis] < -v[2].clip[3]);
+		}
+		if (insideCount == 0 || outside)
+			continue;
+
+		// the clipped polygon has at most four vertices; it is then split as a fan
+		ClipVertex polygon[4];
+		int polygonSize = 0;
+		for (int j=0; j<3; j++) {
+			int k = (j+1)%3;
+			if (distance[j] >= 0)
+				polygon[polygonSize++] = v[j];
+			if ((distance[j] >= 0) != (distance[k] >= 0)) {
+				float s = distance[j] / (distance[j] - distance[k]);
+				ClipVertex &w = polygon[polygonSize++];
+				for (int l=0; l<4; l++)
+					w.clip[l] = v[j].clip[l] + s * (v[k].clip[l] - v[j].clip[l]);
+				for (int l=0; l<3; l++)
+					w.pos[l] = v[j].pos[l] + s * (v[k].pos[l] - v[j].pos[l]);
+			}
+		}
+		for (int j=1; j+1 < polygonSize; j++) {
+			ClipVertex fan[3] = {polygon[0], polygon[j], polygon[j+1]};
+			ScreenTriangle t;
+			if (setupTriangle(fan, imgw, imgh, t))
+				triangles.push_back(t);
+		}
+	}
+
+	// sort the triangles into screen tiles
+	int tileCols = (imgw + tileSize - 1) / tileSize, tileRows = (imgh + tileSize - 1) / tileSize;
+	std::vector< std::vector<int> > bins(tileCols * tileRows);
+	for (int i=0; i < triangles.size(); i++) {
+		const ScreenTriangle &t = triangles[i];
+		for (int ty = t.minY / tileSize; ty <= t.maxY / tileSize; ty++) {
+			for (int tx = t.minX / tileSize; tx <= t.maxX / tileSize; tx++)
+				bins[ty*tileCols + tx].push_back(i);
+		}
+	}
+
+	depth.create(imgh, imgw, CV_32FC1);
+	ids.create(imgh, imgw, CV_32SC1);
+	cv::parallel_for_(cv::Range(0, bins.size()), TileRasterizer(triangles, bins, tileCols, depth, ids));
+}
+
+// Evaluates the fragment shader (shader.frag) on each visible pixel, in parallel over rows
+class ProjectionShader: public cv::ParallelLoopBody {
+	public:
+		ProjectionShader(const std::vector<ScreenTriangle> &triangles, const Mat ids, const Mat frame, const Mat shadow, const cv::Matx44f projector, Mat &result):
+			triangles(triangles), ids(ids), frame(frame), shadow(shadow), projector(projector), result(result) {};
+		virtual void operator()(const cv::Range &range) const {
+			for (int row=range.start; row < range.end; row++) {
+				const int32_t *idRow = ids.ptr<int32_t>(row);
+				uchar *out = result.ptr<uchar>(row);
+				for (int col=0; col < ids.cols; col++) {
+					out[3*col] = out[3*col+1] = out[3*col+2] = 0;
+					if (idRow[col] < 0)
+						continue;
+					const ScreenTriangle &t = triangles[idRow[col]];
+
+					// perspective-correct interpolation of the world space position
+					float px = col + 0.5, py = row + 0.5, weights[3], weightSum = 0;
+					for (int i=0; i<3; i++) {
+						weights[i] = (t.bary[i][0]*px + t.bary[i][1]*py + t.bary[i][2]) * t.invW[i];
+						weightSum += weights[i];
+					}
+					cv::Vec4f pos(0, 0, 0, 1);
+					for (int i=0; i<3; i++) {
+						for (int j=0; j<3; j++)
+							pos[j] += t.pos[i][j] * weights[i] / weightSum;
+					}
+
+					// project the fragment's position from the side camera
+					cv::Vec4f screen = projector * pos;
+					float x = screen[0] / screen[3], y = screen[1] / screen[3], z = screen[2] / screen[3];
+					if (!(x > -1 && x < 1 && y > -1 && y < 1))
+						continue;
+
+					// check for visibility from the side camera, nearest neighbor lookup into the shadow map
+					int shadowCol = IMIN((int)((x+1) * 0.5 * shadow.cols), shadow.cols-1),
+					    shadowRow = shadow.rows - 1 - IMIN((int)((y+1) * 0.5 * shadow.rows), shadow.rows-1);
+					if (!(shadow.at<float>(shadowRow, shadowCol) + shadowBias > z))
+						continue;
+
+					// bilinear texture lookup
+					float fx = (x+1) * 0.5 * frame.cols - 0.5, fy = (1-y) * 0.5 * frame.rows - 0.5;
+					fx = IMIN(IMAX(fx, 0), frame.cols-1);
+					fy = IMIN(IMAX(fy, 0), frame.rows-1);
+					int ix = IMIN((int)fx, frame.cols-2), iy = IMIN((int)fy, frame.rows-2);
+					float wx = fx - ix, wy = fy - iy;
+					const uchar *top = frame.ptr<uchar>(iy), *bottom = frame.ptr<uchar>(iy+1);
+					float value = (top[ix]*(1-wx) + top[ix+1]*wx)*(1-wy) + (bottom[ix]*(1-wx) + bottom[ix+1]*wx)*wy;
+
+					// although it is a RGB, only the red channel is the actual data; G, B are the mask
+					out[3*col] = cv::saturate_cast<uchar>(value);
+					out[3*col+1] = out[3*col+2] = 255;
+				}
+			}
+		}
+	protected:
+		const std::vector<ScreenTriangle> &triangles;
+		const Mat ids, frame, shadow;
+		const cv::Matx44f projector;
+		Mat &result;
+};
+
+// Renders the (previously loaded) scene from the given (main) camera, with frame being projected from projector (aka. side camera)
+Mat RenderSoft::projected(const Mat camera, const Mat frame, const Mat projector)
+{
+	assert(frame.channels() == 1 && frame.depth() == CV_8U);
+	Mat shadow = shadowMap(projector), depth, ids;
+
+	// render the scene and texture it from the projector
+	rasterize(camera, depth, ids);
+	Mat result(imgh, imgw, CV_8UC3);
+	cv::parallel_for_(cv::Range(0, imgh), ProjectionShader(triangles, ids, frame, shadow, cv::Matx44f(projector), result));
+	return result;
+}
+
+// Returns the shadow map for the given projector, rendering it only if it is not cached yet
+Mat RenderSoft::shadowMap(const Mat projector)
+{
+	cv::Matx44f key(projector);
+	for (std::list<ShadowMap>::iterator it = shadowMaps.begin(); it != shadowMaps.end(); it++) {
+		if (it->generation == meshGeneration && std::equal(key.val, key.val + 16, it->projector.val)) {
+			shadowMaps.splice(shadowMaps.begin(), shadowMaps, it);
+			return it->depth;
+		}
+	}
+
+	// generate a shadow map and apply a size 1 dilation filter to reduce shadow acne
+	Mat shadow, ids;
+	rasterize(projector, shadow, ids);
+	cv::dilate(shadow, shadow, Mat());
+
+	if (shadowMaps.size() >= shadowCacheSize)
+		shadowMaps.pop_back();
+	ShadowMap cached = {meshGeneration, key, shadow};
+	shadowMaps.push_front(cached);
+	return shadow;
+}
+
+// Renders the scene with a frame of the video clip (as supplied by loadFrames) projected from projector
+Mat RenderSoft::projected(const Mat camera, int frameNo, const Mat projector)
+{
+	return projected(camera, frames[frameNo], projector);
+}
+
+// Renders the normalized device depth of the scene from given camera, backgroundDepth where empty
+Mat RenderSoft::depth(const Mat camera)
+{
+	Mat result, ids;
+	rasterize(camera, result, ids);
+	return result;
+}
+
+// Renders depth from each of the given cameras; the views are rendered one after another, each of them in parallel
+std::vector<Mat> RenderSoft::depthBatch(const std::vector<Mat> cameras)
+{
+	std::vector<Mat> result;
+	result.reserve(cameras.size());
+	for (int i=0; i < cameras.size(); i++)
+		result.push_back(depth(cameras[i]));
+	return result;
+}
+
+// The rasterizer already uses all the cores, so the asynchronous variants just render immediately
+// and keep the result until it is fetched
+RenderFuture RenderSoft::projectedAsync(const Mat camera, int frameNo, const Mat projector)
+{
+	return finished(projected(camera, frameNo, projector));
+}
+
+RenderFuture RenderSoft::depthAsync(const Mat camera)
+{
+	return finished(depth(camera));
+}
+
+RenderFuture RenderSoft::finished(const Mat result)
+{
+	int slot = nextReadback;
+	assert(readbacks[slot].empty()); // too many renderings pending
+	readbacks[slot] = result;
+	nextReadback = (nextReadback + 1) % readbackSlots;
+	return RenderFuture(this, slot);
+}
+
+Mat RenderSoft::fetch(int slot)
+{
+	Mat result = readbacks[slot];
+	readbacks[slot].release();
+	return result;
+}
+
+#ifdef TEST_BUILD
+// largest difference of normalized device depth from the golden image of the GLX backend
+const float goldenDepthTolerance = 1e-3;
+// largest difference of the projected texture value from the golden image
+const int goldenColorTolerance = 8;
+// fraction of pixels that may exceed the tolerances, as the backends may disagree along the edges of faces and shadows
+const float goldenMismatchFraction = 0.01;
+
+// Same as in render_glx.cpp
+Mat goldenTexture(int width, int height)
+{
+	Mat texture(height, width, CV_8UC1);
+	for (int i=0; i<height; i++) {
+		for (int j=0; j<width; j++)
+			texture.at<uchar>(i, j) = cv::saturate_cast<uchar>(128 + 100 * sin(j / 20.) * cos(i / 20.));
+	}
+	return texture;
+}
+
+// Compare the renderings with the golden images written by the GLX backend ('make golden_glx'); returns false if they differ
+// the comparison is skipped (and counts as a match) if the golden images are missing
+bool matchesGolden(RenderSoft &r, const Mat camera, const Mat projector)
+{
+	Mat goldenDepth = cv::imread("test/golden-depth.png", -1), goldenProjected = cv::imread("test/golden-projected.png");
+	if (goldenDepth.empty() || goldenProjected.empty()) {
+		std::cout << "Skipping the comparison with the GLX backend: golden images not found, create them by 'make golden_glx'" << std::endl;
+		return true;
+	}
+	Mat depth = r.depth(camera), projected = r.projected(camera, goldenTexture(640, 480), projector);
+	int depthMismatches = 0, projectedMismatches = 0;
+	for (int i=0; i < depth.rows; i++) {
+		for (int j=0; j < depth.cols; j++) {
+			float reference = goldenDepth.at<uint16_t>(i, j) * (2 / 65535.) - 1;
+			if (fabs(depth.at<float>(i, j) - reference) > goldenDepthTolerance)
+				depthMismatches++;
+			cv::Vec3b color = projected.at<cv::Vec3b>(i, j), referenceColor = goldenProjected.at<cv::Vec3b>(i, j);
+			if (color[1] != referenceColor[1] || abs(color[0] - referenceColor[0]) > goldenColorTolerance)
+				projectedMismatches++;
+		}
+	}
+	int limit = goldenMismatchFraction * depth.total();
+	std::cout << "Pixels differing from the GLX backend: depth " << depthMismatches << ", projected " << projectedMismatches << " (at most " << limit << " allowed)" << std::endl;
+	return depthMismatches <= limit && projectedMismatches <= limit;
+}
+
+// Main function for testing of the shadows etc., equivalent to the one in render_glx.cpp
+// should output files 'depth.png' (black and white) and 'projected.png' (mostly yellow and black)
+// and checks the renderings against the golden images of the GLX backend; returns nonzero if they do not match
+int main(int argc, char ** argv)
+{
+	RenderSoft r = RenderSoft(640, 480);
+
+Mat points = (cv::Mat_<float>(25.0, 4) << 0.5127, -3.9222, -29.4300, 1.0000, 0.6195, -0.2643, -27.4378, 1.0000, 4.5767, 0.2684, -28.6282, 1.0000, 4.4699, -3.3895, -30.6204, 1.0000, 1.8125, -5.8448, -25.9695, 1.0000, 1.9193, -2.1869, -23.9774, 1.0000, 5.8765, -1.6541, -25.1678, 1.0000, -3.7263, 1.9956, -20.7352, 1.0000, -5.1135, -5.5956, -28.2388, 1.0000, -5.0067, -1.9377, -26.2467, 1.0000, -1.0495, -1.4050, -27.4371, 1.0000, -1.1563, -5.0629, -29.4292, 1.0000, -3.8137, -7.5182, -24.7784, 1.0000, 0.2503, -3.3276, -23.9766, 1.0000, 0.1435, -6.9855, -25.9688, 1.0000, -4.5209, -0.3826, -22.9609, 1.0000, -4.4455, 2.1991, -21.5549, 1.0000, -1.6526, 2.5750, -22.3950, 1.0000, -1.7281, -0.0066, -23.8010, 1.0000, -3.6036, -1.7395, -20.5186, 1.0000, -3.5282, 0.8422, -19.1126, 1.0000, -0.7353, 1.2181, -19.9528, 1.0000, -0.8107, -1.3635, -21.3588, 1.0000, -3.3029, 1.3693, -19.6080, 1.0000, -2.0139, 1.5429, -19.9957, 1.0000);
+Mat indices = (cv::Mat_<int32_t>(27.0, 3) << 4, 5, 1, 5, 6, 1, 0, 1, 2, 13, 14, 11, 14, 12, 8, 8, 9, 10, 19, 20, 16, 20, 21, 16, 21, 22, 17, 22, 19, 18, 15, 16, 17, 22, 21, 20, 0, 4, 1, 21, 17, 16, 13, 10, 9, 3, 0, 2, 8, 12, 9, 22, 18, 17, 10, 13, 11, 11, 14, 8, 11, 8, 10, 15, 19, 16, 23, 24, 7, 6, 2, 1, 18, 15, 17, 19, 22, 20, 19, 15, 18);
+Mat MVP(cv::Matx44f(-1.195982575416565, 1.350219488143921, 1.237614393234253, 30.956573486328125, -0.1888779103755951, -2.055802583694458, 2.06032657623291, 47.59274673461914, -1.0203083753585815, -0.42725738883018494, -0.519854724407196, 2.6755423545837402, -0.834797739982605, -0.3495742380619049, -0.42533570528030396, 7.643625259399414));
+Mat sideMVP(cv::Matx44f(-1.831691861152649, -1.1502554416656494, -0.3270684480667114, -11.764444351196289, 1.391772985458374, -2.4397428035736084, 0.7858548760414124, 19.515047073364258, 0.3260231614112854, -0.188545361161232, -1.1627495288848877, -21.932016372680664, 0.2667462229728699, -0.1542643904685974, -0.9513405561447144, -12.489831924438477));
+
+	r.loadMesh(Mesh(points, indices));
+	bool okay = matchesGolden(r, MVP, sideMVP);
+	Mat tex = cv::imread("test/grid.png");
+	if (tex.empty()) {
+		std::cout << "Skipping 'projected.png': texture test/grid.png not found" << std::endl;
+	} else {
+		cv::cvtColor(tex, tex, CV_RGB2GRAY);
+		Mat frame = r.projected(MVP, tex, sideMVP);
+		cv::imwrite("projected.png", frame);
+	}
+	Mat depth = r.depth(MVP);
+	double min, max;
+	minMaxIdx(depth, &min, &max);
+	if (min != max)
+		depth = 255 * (depth - min) / (max - min);
+	cv::imwrite("depth.png", depth);
+	std::cout << "Depth min: " << min << ", max: " << max << std::endl;
+	return okay ? 0 : 1;
+}
+#endif
@@ -13,7 +13,15 @@ void main(){
 	// project the fragment's position from the side camera
 	vec4 screenCoord = sideMVP * modelCoord;
 	// check for visibility from the side camera
-	float shadowDepth = texture(shadowSampler, (screenCoord.xy / (2*screenCoord.w)) - 0.5).r * 2 - 1;
+	// the shadow map is dilated by one texel (maximum over a 3x3 window) to reduce shadow acne
+	ivec2 shadowSize = textureSize(shadowSampler, 0);
+	ivec2 shadowTexel = ivec2(floor(fract((screenCoord.xy / (2*screenCoord.w)) - 0.5) * vec2(shadowSize)));
+	float shadowDepth = 0.0;
+	for (int dy = -1; dy <= 1; dy++) {
+		for (int dx = -1; dx <= 1; dx++)
+			shadowDepth = max(shadowDepth, texelFetch(shadowSampler, clamp(shadowTexel + ivec2(dx, dy), ivec2(0), shadowSize - 1), 0).r);
+	}
+	shadowDepth = shadowDepth * 2 - 1;
 	bool visible = shadowDepth + 0.01 > screenCoord.z/screenCoord.w;
 	bool inframe = (screenCoord.x/screenCoord.w > -1 && screenCoord.x/screenCoord.w < 1 && screenCoord.y/screenCoord.w > -1 && screenCoord.y/screenCoord.w < 1);
 	// disabled: check correctly faced normal
@@ -1,14 +1,14 @@
 #version 330 core
 
-layout(location = 0) in vec3 vertexPosition_modelspace;
+layout(location = 0) in vec4 vertexPosition_homogeneous;
 
 out vec3 pos; // world space position; will get linearly interpolated for all fragments
 
 uniform mat4 mainMVP;
 
 void main(){
-	// set vertex position from the Vertex Buffer Object
-	gl_Position = mainMVP * vec4(vertexPosition_modelspace, 1);
-	pos = vertexPosition_modelspace;
+	// set vertex position from the Vertex Buffer Object, dehomogenized so that interpolation is not affected by its w coordinate
+	pos = vertexPosition_homogeneous.xyz / vertexPosition_homogeneous.w;
+	gl_Position = mainMVP * vec4(pos, 1);
 }
 
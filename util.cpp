@@ -5,12 +5,19 @@
 #include <opencv2/imgproc/imgproc.hpp>
 #include <fstream>
 #include <vector>
+#include <algorithm>
 #include <cstring>
 
 #include "recon.hpp"
 
 #define USE_COVAR_MATRICES
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+	#define HALF_F16C
+	#define TRIANGULATE_SIMD
+	#include <immintrin.h>
+#endif
+
 // convert 3D homogeneous points to their Cartesian representation
 // expects points in rows, returns a new n x 3 matrix
 Mat dehomogenize(const Mat points) 
@@ -52,303 +59,650 @@ bool goodSample(const Mat image, const float x, const float y)
 	        image.at<float>(iy+1,ix+1) != backgroundDepth);
 }
 
-// Triangulate a 3D homogeneous point at given pixel position
-// x, y: camera-space positions in [-1; 1]
-// measuredPoints: 2D points in columns, i-th column corresponding to cameras[i]
-// invVariances: (if USE_COVAR_MATRICES) data joined from all the covariance matrices, each row corresponding to a side camera with the same index
-//               (if not USE_COVAR_MATRICES) a vector of \sigma^{-2}, each corresponding to a side camera with the same index
-// cameras: side cameras, list of matrices
-// depth: initial depth estimate
-DensityPoint triangulatePixel(float x, float y, const Mat measuredPoints, const Mat invVariances, const Mat mainCameraInv, const MatList cameras, float depth) {
-	// estimated point as seen by main camera (only the 3rd coordinate may change during optimization)
-	Mat k(cv::Vec4f(x, y, depth, 1)); 
-	// estimated point, projected to each camera (in columns) and its derivative wrt. z
-	Mat p(2, cameras.size(), CV_32FC1), delta_p(2, cameras.size(), CV_32FC1); 
-	// derivative of homogeneous x, y projected to each camera (in columns) wrt. z in main camera's space
-	Mat projectionDerivatives(2, cameras.size(), CV_32FC1); 
-	// projection from main camera space to each camera's space (in rows); result of multiplication is just the w coordinate of each point
-	Mat projectionW(cameras.size(), 4, CV_32FC1); 
-	// in the last run, save probability density of the resulting point to this variable
-	float pdf = 1.0; 
-	
-	#ifdef USE_COVAR_MATRICES
-	std::vector<Mat> icovars;
-	icovars.reserve(invVariances.rows);
-	for (int i=0; i<invVariances.rows; i++) {
-		icovars.push_back(invVariances.row(i).reshape(1,2));
+// == Batched triangulation ==
+// The depth of each pixel is refined by Newton's method on its own, but the pixels are solved several at once
+// in structure-of-arrays form, one pixel per SIMD lane; lanes that converged are masked out
+
+// number of pixels collected before they are solved; a multiple of all the vector widths
+const int triangulationBatchSize = 256;
+// maximal number of Newton steps for each pixel
+const int triangulationIterations = 50;
+// the refinement ends when the step is smaller than this
+const float triangulationEpsilon = 1e-7;
+
+// Pixels to be triangulated together; per-camera values are stored at [camera * triangulationBatchSize + pixel]
+// each side camera projects a pixel at depth z to (base + z*deriv), where base is the projection of (x, y, 0, 1)
+struct TriangulationBatch {
+	int size, cameraCount;
+	std::vector<float> x, y, z; // camera-space position of each pixel, z being the current depth estimate
+	std::vector<int> row, col; // position of each pixel in the grid of triangulated pixels
+	std::vector<float> baseX, baseY, baseW;
+	std::vector<float> measuredX, measuredY; // points expected by the optical flow
+	std::vector<float> ivarA, ivarB, ivarD; // inverted covariance matrix [a b; b d] (if USE_COVAR_MATRICES), or \sigma^{-2} in ivarA
+	std::vector<float> derivX, derivY, derivW; // third column of each side camera's projection from main camera's space, one per camera
+	TriangulationBatch(const std::vector<cv::Matx44f> &projections):
+		size(0), cameraCount(projections.size()),
+		x(triangulationBatchSize), y(triangulationBatchSize), z(triangulationBatchSize), row(triangulationBatchSize), col(triangulationBatchSize),
+		baseX(cameraCount * triangulationBatchSize), baseY(cameraCount * triangulationBatchSize), baseW(cameraCount * triangulationBatchSize),
+		measuredX(cameraCount * triangulationBatchSize), measuredY(cameraCount * triangulationBatchSize),
+		ivarA(cameraCount * triangulationBatchSize), ivarB(cameraCount * triangulationBatchSize), ivarD(cameraCount * triangulationBatchSize),
+		derivX(cameraCount), derivY(cameraCount), derivW(cameraCount)
+	{
+		for (int i=0; i<cameraCount; i++) {
+			derivX[i] = projections[i](0,2);
+			derivY[i] = projections[i](1,2);
+			derivW[i] = projections[i](3,2);
+		}
 	}
-	#else
-	const float *ivar = invVariances.ptr<float>(0);
-	#endif
-	
-	// initialize the projectionDerivatives and projectionW matrices
-	{int i=0;	for (MatList::const_iterator camera=cameras.begin(); camera!=cameras.end(); camera++, i++) {
-		Mat(camera->rowRange(0,2) * mainCameraInv.col(2)).copyTo(projectionDerivatives.col(i));
-		camera->row(3).copyTo(projectionW.row(i));
-	}}
-	projectionW = projectionW * mainCameraInv;
-	// * now the projection is complete *
-	
-	// size of the last step; may be used for some heuristics during the minimization
-	float last_delta_z = depth;
-	
-	// minimize the energy function
-	for (int iterCount=0; ; iterCount++) {
-		// calculate projected positions from side cameras of the current point estimate
-		{int i=0;	for (MatList::const_iterator camera=cameras.begin(); camera!=cameras.end(); camera++, i++) {
-			Mat estimatedPoint = *camera * mainCameraInv * k;
-			estimatedPoint /= estimatedPoint.at<float>(3);
-			estimatedPoint.rowRange(0,2).copyTo(p.col(i));
-		}}
-		
-		// calculate the third column of the Jacobian matrix J_{C^i}, value for each side camera C^i stored in column i
-		Mat pointsW = projectionW * k;
-		pointsW = pointsW.t();
-		cv::divide(projectionDerivatives.row(0), pointsW, delta_p.row(0));
-		cv::divide(projectionDerivatives.row(1), pointsW, delta_p.row(1));
-		
-		// calculate the first and the second derivative at the current point
-		double firstDz = 0, secondDz = 0;
-		Mat difference = p - measuredPoints;
-		for (int i=0; i<delta_p.cols; i++) {
+};
+
+// Difference of the projected point from the measured one and its derivative wrt. z, for a single pixel and side camera
+// at: index of the pixel and camera in the batch
+inline void projectionError(const TriangulationBatch &b, int i, int at, float z, float &diffX, float &diffY, float &derivX, float &derivY)
+{
+	float inv = 1 / (b.baseW[at] + z*b.derivW[i]);
+	diffX = (b.baseX[at] + z*b.derivX[i]) * inv - b.measuredX[at];
+	diffY = (b.baseY[at] + z*b.derivY[i]) * inv - b.measuredY[at];
+	derivX = b.derivX[i] * inv;
+	derivY = b.derivY[i] * inv;
+}
+
+// Refine the depth of pixels begin, ..., end-1 of the batch, one at a time
+void newtonScalar(TriangulationBatch &b, int begin, int end)
+{
+	for (int p=begin; p<end; p++) {
+		float z = b.z[p];
+		for (int iterCount=0; iterCount < triangulationIterations; iterCount++) {
+			// calculate the first and the second derivative at the current point
+			double firstDz = 0, secondDz = 0;
+			for (int i=0; i<b.cameraCount; i++) {
+				int at = i*triangulationBatchSize + p;
+				float diffX, diffY, derivX, derivY;
+				projectionError(b, i, at, z, diffX, diffY, derivX, derivY);
+				#ifdef USE_COVAR_MATRICES
+				float transX = b.ivarA[at]*derivX + b.ivarB[at]*derivY,
+				      transY = b.ivarB[at]*derivX + b.ivarD[at]*derivY;
+				firstDz += diffX*transX + diffY*transY;
+				secondDz += derivX*transX + derivY*transY;
+				#else
+				firstDz += (derivX*diffX + derivY*diffY) * b.ivarA[at];
+				secondDz += (derivX*derivX + derivY*derivY) * b.ivarA[at];
+				#endif
+			}
+			// calculate the update step and end if it would be small enough
+			double delta_z = -firstDz/secondDz;
+			if (delta_z < triangulationEpsilon && delta_z > -triangulationEpsilon)
+				break;
+			z += delta_z;
+		}
+		b.z[p] = z;
+	}
+}
+
+#ifdef TRIANGULATE_SIMD
+// Same as newtonScalar on the eight pixels starting at begin
+__attribute__((target("avx2,fma")))
+void newtonAVX2(TriangulationBatch &b, int begin)
+{
+	const __m256 zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1), epsilon = _mm256_set1_ps(triangulationEpsilon),
+	             absMask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+	__m256 z = _mm256_loadu_ps(&b.z[begin]);
+	__m256 active = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+	for (int iterCount=0; iterCount < triangulationIterations; iterCount++) {
+		__m256 firstDz = zero, secondDz = zero;
+		for (int i=0; i<b.cameraCount; i++) {
+			int at = i*triangulationBatchSize + begin;
+			__m256 dX = _mm256_set1_ps(b.derivX[i]), dY = _mm256_set1_ps(b.derivY[i]), dW = _mm256_set1_ps(b.derivW[i]);
+			__m256 inv = _mm256_div_ps(one, _mm256_fmadd_ps(z, dW, _mm256_loadu_ps(&b.baseW[at])));
+			__m256 diffX = _mm256_sub_ps(_mm256_mul_ps(_mm256_fmadd_ps(z, dX, _mm256_loadu_ps(&b.baseX[at])), inv), _mm256_loadu_ps(&b.measuredX[at])),
+			       diffY = _mm256_sub_ps(_mm256_mul_ps(_mm256_fmadd_ps(z, dY, _mm256_loadu_ps(&b.baseY[at])), inv), _mm256_loadu_ps(&b.measuredY[at])),
+			       derivX = _mm256_mul_ps(dX, inv), derivY = _mm256_mul_ps(dY, inv);
 			#ifdef USE_COVAR_MATRICES
-			Mat transformed = icovars[i] * delta_p.col(i);
-			firstDz += difference.col(i).dot(transformed);
-			secondDz += delta_p.col(i).dot(transformed);
+			__m256 ivarB = _mm256_loadu_ps(&b.ivarB[at]);
+			__m256 transX = _mm256_fmadd_ps(_mm256_loadu_ps(&b.ivarA[at]), derivX, _mm256_mul_ps(ivarB, derivY)),
+			       transY = _mm256_fmadd_ps(ivarB, derivX, _mm256_mul_ps(_mm256_loadu_ps(&b.ivarD[at]), derivY));
+			firstDz = _mm256_fmadd_ps(diffX, transX, _mm256_fmadd_ps(diffY, transY, firstDz));
+			secondDz = _mm256_fmadd_ps(derivX, transX, _mm256_fmadd_ps(derivY, transY, secondDz));
 			#else
-			firstDz += delta_p.col(i).dot(difference.col(i)) * ivar[i];
-			secondDz += delta_p.col(i).dot(delta_p.col(i)) * ivar[i];
+			__m256 ivar = _mm256_loadu_ps(&b.ivarA[at]);
+			firstDz = _mm256_fmadd_ps(_mm256_fmadd_ps(derivX, diffX, _mm256_mul_ps(derivY, diffY)), ivar, firstDz);
+			secondDz = _mm256_fmadd_ps(_mm256_fmadd_ps(derivX, derivX, _mm256_mul_ps(derivY, derivY)), ivar, secondDz);
 			#endif
 		}
-		
-		// calculate the update step and end if it would be small enough
-		double delta_z = -firstDz/secondDz, eps = 1e-7;
-		if (iterCount >= 50 || (delta_z < eps && delta_z > -eps)) {
-			// calculate the combined probability of the result
-			double exponent = 0, product_ivar = 1;
+		__m256 delta_z = _mm256_sub_ps(zero, _mm256_div_ps(firstDz, secondDz));
+		// a lane stays active unless its step is small enough (NaN's included, as in newtonScalar)
+		active = _mm256_and_ps(active, _mm256_cmp_ps(_mm256_and_ps(delta_z, absMask), epsilon, _CMP_NLT_UQ));
+		if (!_mm256_movemask_ps(active))
+			break;
+		z = _mm256_add_ps(z, _mm256_and_ps(active, delta_z));
+	}
+	_mm256_storeu_ps(&b.z[begin], z);
+}
+
+// Same as newtonScalar on the sixteen pixels starting at begin
+__attribute__((target("avx512f")))
+void newtonAVX512(TriangulationBatch &b, int begin)
+{
+	const __m512 zero = _mm512_setzero_ps(), one = _mm512_set1_ps(1), epsilon = _mm512_set1_ps(triangulationEpsilon);
+	__m512 z = _mm512_loadu_ps(&b.z[begin]);
+	__mmask16 active = 0xffff;
+	for (int iterCount=0; iterCount < triangulationIterations; iterCount++) {
+		__m512 firstDz = zero, secondDz = zero;
+		for (int i=0; i<b.cameraCount; i++) {
+			int at = i*triangulationBatchSize + begin;
+			__m512 dX = _mm512_set1_ps(b.derivX[i]), dY = _mm512_set1_ps(b.derivY[i]), dW = _mm512_set1_ps(b.derivW[i]);
+			__m512 inv = _mm512_div_ps(one, _mm512_fmadd_ps(z, dW, _mm512_loadu_ps(&b.baseW[at])));
+			__m512 diffX = _mm512_sub_ps(_mm512_mul_ps(_mm512_fmadd_ps(z, dX, _mm512_loadu_ps(&b.baseX[at])), inv), _mm512_loadu_ps(&b.measuredX[at])),
+			       diffY = _mm512_sub_ps(_mm512_mul_ps(_mm512_fmadd_ps(z, dY, _mm512_loadu_ps(&b.baseY[at])), inv), _mm512_loadu_ps(&b.measuredY[at])),
+			       derivX = _mm512_mul_ps(dX, inv), derivY = _mm512_mul_ps(dY, inv);
 			#ifdef USE_COVAR_MATRICES
-			for (int i=0; i<difference.cols; i++) {
-				Mat transformed = icovars[i] * difference.col(i);
-				exponent -= difference.col(i).dot(transformed);
-				product_ivar *= cv::determinant(icovars[i]);
-			}
+			__m512 ivarB = _mm512_loadu_ps(&b.ivarB[at]);
+			__m512 transX = _mm512_fmadd_ps(_mm512_loadu_ps(&b.ivarA[at]), derivX, _mm512_mul_ps(ivarB, derivY)),
+			       transY = _mm512_fmadd_ps(ivarB, derivX, _mm512_mul_ps(_mm512_loadu_ps(&b.ivarD[at]), derivY));
+			firstDz = _mm512_fmadd_ps(diffX, transX, _mm512_fmadd_ps(diffY, transY, firstDz));
+			secondDz = _mm512_fmadd_ps(derivX, transX, _mm512_fmadd_ps(derivY, transY, secondDz));
 			#else
-			for (int i=0; i<difference.cols; i++) {
-				exponent -= difference.col(i).dot(difference.col(i));
-				product_ivar *= ivar[i];
-			}
+			__m512 ivar = _mm512_loadu_ps(&b.ivarA[at]);
+			firstDz = _mm512_fmadd_ps(_mm512_fmadd_ps(derivX, diffX, _mm512_mul_ps(derivY, diffY)), ivar, firstDz);
+			secondDz = _mm512_fmadd_ps(_mm512_fmadd_ps(derivX, derivX, _mm512_mul_ps(derivY, derivY)), ivar, secondDz);
 			#endif
-			pdf = 0.159 * product_ivar * exp(0.5*exponent);
-			break;
 		}
-		
-		// DISABLED: minimization heuristics and camera constraints
-		// apply sanity constraints to delta_z (so that the point does not get too close to any of the cameras)
-		//float reasonableStep = 0.5, worstStep = reasonableStep;
-		//{int i=0;	for (MatList::const_iterator camera=cameras.begin(); camera!=cameras.end(); camera++, i++) {
-		//	float thisStep = 1 + delta_z * camera->row(3).t().dot(mainCameraInv.col(2)) / pointsW.at<float>(i);
-		//	if (thisStep < worstStep)
-		//		worstStep = thisStep;
-		//}}
-		//if (worstStep < reasonableStep) {
-		//	delta_z = (worstStep - 1) / (reasonableStep - 1);
-		//}
-		// another heuristic so that it does not jump back and forth
-		//if ((delta_z > 0 && last_delta_z < 0 && 2*delta_z > -last_delta_z) ||
-		//    (delta_z < 0 && last_delta_z > 0 && -2*delta_z > last_delta_z))
-		//	delta_z = -last_delta_z/2;
-		k.at<float>(2) += delta_z;
-		last_delta_z = delta_z;
-	}
-	return DensityPoint(mainCameraInv*k, pdf);
+		__m512 delta_z = _mm512_sub_ps(zero, _mm512_div_ps(firstDz, secondDz));
+		active = _mm512_mask_cmp_ps_mask(active, _mm512_abs_ps(delta_z), epsilon, _CMP_NLT_UQ);
+		if (!active)
+			break;
+		z = _mm512_mask_add_ps(z, active, z, delta_z);
+	}
+	_mm512_storeu_ps(&b.z[begin], z);
 }
 
-// Triangulate all available pixels of the main camera's frame
-Mat triangulatePixels(const MatList flows, const Mat mainCamera, const MatList cameras, const Mat depth)
+static const bool hasAVX2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+static const bool hasAVX512 = __builtin_cpu_supports("avx512f");
+#endif
+
+// Refine the depth of all pixels in the batch, as many at once as the CPU allows
+void newtonBatch(TriangulationBatch &b)
 {
-	int width = depth.cols, height = depth.rows;
-	
-	// point \in P^3, normal (scaled by probability) \in R^3
-	Mat points(depth.rows*depth.cols, 4+3, CV_32FC1);
-	int pixelId=0;
-	Mat mainCameraInv = mainCamera.inv();
-	#ifdef USE_COVAR_MATRICES
-	Mat gradient = imageGradient(depth);
+	int p = 0;
+	#ifdef TRIANGULATE_SIMD
+	if (hasAVX512) {
+		for (; p + 16 <= b.size; p += 16)
+			newtonAVX512(b, p);
+	}
+	if (hasAVX2) {
+		for (; p + 8 <= b.size; p += 8)
+			newtonAVX2(b, p);
+	}
 	#endif
-	Mat pixelIndices = -Mat::ones(height, width, CV_32SC1);
-
-	for (int row=0; row < depth.rows; row++) {
-		const float *depthRow = depth.ptr<float>(row); // you'll never get me down to Depth Row! --Judas Priest
-		for (int col=0; col < depth.cols; col++) {
-			if (depthRow[col] != backgroundDepth) {
-				bool okay = true;
-				float centerX = depth.cols/2.0, centerY = depth.rows/2.0;
-				float scaleX = 2.0/depth.cols, scaleY = 2.0/depth.rows,
-				      x = (col-centerX)*scaleX,
-				      y = (centerY-row)*scaleY;
-	      // points expected by the optical flow, for each side camera (in columns)
-				Mat measuredPoints(2, cameras.size(), CV_32FC1);
-				
-				#ifdef USE_COVAR_MATRICES
-				// inverted covariance matrices of each optical flow around this pixel, each a single row
-				Mat invVariances(cameras.size(), 1, CV_32FC4);
-				#else
-				// estimated variance of each optical flow around this pixel
-				Mat invVariances(cameras.size(), 1, CV_32FC1);
-				#endif
-				
-				// process each side camera separately and calculate its measured point s^i using the optical flow
-				{int i=0;	for (MatList::const_iterator camera=cameras.begin(), flow=flows.begin(); camera!=cameras.end(); camera++, flow++, i++) {
-					// get optical flow and its estimated variance at the given pixel
-					cv::Scalar_<float> fl = flow->at< cv::Scalar_<float> > (row, col);
-					float flx = fl[0], fly = fl[1],
-					      variance = fl[2];
-					
-					// try to sample from the projected position; if that is not meaningful, use original pixel's depth
-					float z = goodSample(depth, col+flx, row+fly) ? sampleImage<float>(depth, col + flx, row + fly) : depthRow[col];
-					Mat measuredPoint = *camera * mainCameraInv * Mat(cv::Vec4f(x + flx*scaleX, y + fly*scaleY, z, 1));
-					
-					#ifdef USE_COVAR_MATRICES
-					// get affine matrix of the raycast mapping (image coordinates to camera space)
-					Mat D = Mat::eye(3, 2, CV_32FC1);
-					if (goodSample(depth, col+flx, row+fly))
-						D.reshape(2).at<cv::Point>(2) = sampleImage<cv::Point>(gradient, col+flx, row+fly);
-					else
-						D.reshape(2).at<cv::Point>(2) = sampleImage<cv::Point>(gradient, col, row);
-					// combine it with affine mappings of the camera back-projection and projection
-					Mat A = camera->rowRange(0,2).colRange(0,3) * mainCameraInv.rowRange(0,3).colRange(0,3) * D;
-					A /= measuredPoint.at<float>(3);
-					// calculate the inverse of the covariance matrix
-					Mat icovarMatrix = (A * A.t()).inv() / variance;
-					icovarMatrix.reshape(4, 1).copyTo(invVariances.row(i));
-					#else
-					invVariances.at<float>(i) = 1/variance;
-					#endif
-					
-					measuredPoint /= measuredPoint.at<float>(3);
-					if (measuredPoint.at<float>(2) < -1) {
-						//printf(" One camera sees this point with depth %g, skipping\n", measuredPoint.at<float>(2));
-						okay = false;
-						break;
+	newtonScalar(b, p, b.size);
+}
+
+// Triangulate all pixels of the batch, and append the resulting points to rows of points starting at pixelId
+// each row has the form (x, y, z, w, density); returns the index of the next free row
+int triangulateBatch(TriangulationBatch &b, const std::vector<cv::Matx44f> &projections, const cv::Matx44f &mainCameraInv, Mat &points, Mat &pixelIndices, int pixelId)
+{
+	newtonBatch(b);
+	for (int p=0; p<b.size; p++, pixelId++) {
+		// calculate the combined probability of the result
+		double exponent = 0, product_ivar = 1;
+		for (int i=0; i<b.cameraCount; i++) {
+			int at = i*triangulationBatchSize + p;
+			float diffX, diffY, derivX, derivY;
+			projectionError(b, i, at, b.z[p], diffX, diffY, derivX, derivY);
+			#ifdef USE_COVAR_MATRICES
+			exponent -= diffX * (b.ivarA[at]*diffX + b.ivarB[at]*diffY) + diffY * (b.ivarB[at]*diffX + b.ivarD[at]*diffY);
+			product_ivar *= b.ivarA[at]*b.ivarD[at] - b.ivarB[at]*b.ivarB[at];
+			#else
+			exponent -= diffX*diffX + diffY*diffY;
+			product_ivar *= b.ivarA[at];
+			#endif
+		}
+		cv::Vec4f point = mainCameraInv * cv::Vec4f(b.x[p], b.y[p], b.z[p], 1);
+		float *out = points.ptr<float>(pixelId);
+		for (int j=0; j<4; j++)
+			out[j] = point[j];
+		// save the density of the point to be processed later in triangulatePixels
+		out[4] = 0.159 * product_ivar * exp(0.5*exponent);
+		pixelIndices.at<int32_t>(b.row[p], b.col[p]) = pixelId;
+	}
+	b.size = 0;
+	return pixelId;
+}
+
+// half size of the square neighborhood to be considered in normal estimation, in triangulated pixels
+const int normalRadius = 10;
+// largest pixel stride for triangulation, so that no scale of the scene can thin a main frame out to a handful of points
+const int maxPixelStride = normalRadius;
+
+// Pixel stride for triangulation such that neighboring triangulated points are about spacing apart in the scene
+// the size of a pixel in the scene is estimated from the depth map, as a median over a sparse grid of foreground pixels
+int pixelStride(const Mat depth, const Mat camera, const cv::Rect roi, float spacing)
+{
+	// distance of the sampled pixels
+	const int step = 4;
+	if (spacing <= 0)
+		return 1;
+	cv::Matx44f cameraInv = Mat(camera.inv());
+	float centerX = depth.cols/2.0, centerY = depth.rows/2.0;
+	float scaleX = 2.0/depth.cols, scaleY = 2.0/depth.rows;
+	std::vector<float> sizes;
+	for (int row=roi.y; row+1 < roi.y+roi.height; row += step) {
+		const float *depthRow = depth.ptr<float>(row), *nextRow = depth.ptr<float>(row+1);
+		for (int col=roi.x; col+1 < roi.x+roi.width; col += step) {
+			if (depthRow[col] == backgroundDepth || depthRow[col+1] == backgroundDepth || nextRow[col] == backgroundDepth)
+				continue;
+			// the pixel and its right and bottom neighbors, back-projected to the scene
+			cv::Vec4f corner = cameraInv * cv::Vec4f((col-centerX)*scaleX, (centerY-row)*scaleY, depthRow[col], 1),
+			          right = cameraInv * cv::Vec4f((col+1-centerX)*scaleX, (centerY-row)*scaleY, depthRow[col+1], 1),
+			          bottom = cameraInv * cv::Vec4f((col-centerX)*scaleX, (centerY-row-1)*scaleY, nextRow[col], 1);
+			cv::Vec3f a(corner[0]/corner[3], corner[1]/corner[3], corner[2]/corner[3]),
+			          b(right[0]/right[3], right[1]/right[3], right[2]/right[3]),
+			          c(bottom[0]/bottom[3], bottom[1]/bottom[3], bottom[2]/bottom[3]);
+			// square root of the area of the surface covered by the pixel
+			sizes.push_back(sqrt(cv::norm((b - a).cross(c - a))));
+		}
+	}
+	if (sizes.empty())
+		return 1;
+	// the median ignores pixels on depth discontinuities, which seem huge
+	std::nth_element(sizes.begin(), sizes.begin() + sizes.size()/2, sizes.end());
+	float size = sizes[sizes.size()/2];
+	if (!(size > 0))
+		return 1;
+	return IMAX(1, IMIN((int)(spacing / size), maxPixelStride));
+}
+
+// triangulated rows of the main frame processed by one task in triangulatePixels (a tile spans stride times as many rows of the frame)
+const int triangulationTileRows = 8;
+
+// Triangulates the pixels of each tile of rows into a block of points of its own;
+// pixelIndices of these pixels are set relative to the start of the block
+class TriangulateTiles: public cv::ParallelLoopBody {
+	public:
+		TriangulateTiles(const MatList &flows, const Mat &depth, const Mat &gradient, const cv::Rect &roi, int stride, const std::vector<cv::Matx44f> &projections,
+		                 const std::vector<cv::Matx23f> &linearProjections, const cv::Matx44f &mainCameraInv, std::vector<Mat> &blocks, Mat &pixelIndices):
+			flows(flows), depth(depth), gradient(gradient), roi(roi), stride(stride), projections(projections), linearProjections(linearProjections),
+			mainCameraInv(mainCameraInv), blocks(blocks), pixelIndices(pixelIndices) {};
+		void operator()(const cv::Range &range) const
+		{
+			// pixels waiting to be triangulated
+			TriangulationBatch batch(projections);
+			for (int tile=range.start; tile < range.end; tile++) {
+				int begin = roi.y + tile*triangulationTileRows*stride, end = IMIN(begin + triangulationTileRows*stride, roi.y + roi.height);
+				Mat block(((end - begin + stride - 1) / stride) * ((roi.width + stride - 1) / stride), 4+3, CV_32FC1);
+				int count = 0;
+				for (int row=begin; row < end; row += stride) {
+					const float *depthRow = depth.ptr<float>(row); // you'll never get me down to Depth Row! --Judas Priest
+					for (int col=roi.x; col < roi.x+roi.width; col += stride) {
+						if (depthRow[col] != backgroundDepth) {
+							bool okay = true;
+							float centerX = depth.cols/2.0, centerY = depth.rows/2.0;
+							float scaleX = 2.0/depth.cols, scaleY = 2.0/depth.rows,
+							      x = (col-centerX)*scaleX,
+							      y = (centerY-row)*scaleY;
+
+							// process each side camera separately and calculate its measured point s^i using the optical flow
+							int lane = batch.size;
+							{int i=0;	for (MatList::const_iterator flow=flows.begin(); flow!=flows.end(); flow++, i++) {
+								int at = i*triangulationBatchSize + lane;
+								// get optical flow and its estimated variance at the given pixel
+								const uint16_t *fl = flow->ptr<uint16_t>(row-roi.y) + 4*(col-roi.x);
+								float flx = halfToFloat(fl[0]), fly = halfToFloat(fl[1]),
+								      variance = halfToFloat(fl[2]);
+
+								// try to sample from the projected position; if that is not meaningful, use original pixel's depth
+								float z = goodSample(depth, col+flx, row+fly) ? sampleImage<float>(depth, col + flx, row + fly) : depthRow[col];
+								cv::Vec4f measuredPoint = projections[i] * cv::Vec4f(x + flx*scaleX, y + fly*scaleY, z, 1);
+
+								#ifdef USE_COVAR_MATRICES
+								// get affine matrix of the raycast mapping (image coordinates to camera space)
+								cv::Point2f slope = goodSample(depth, col+flx, row+fly) ? sampleImage<cv::Point2f>(gradient, col+flx, row+fly) : sampleImage<cv::Point2f>(gradient, col, row);
+								cv::Matx32f D(1, 0, 0, 1, slope.x, slope.y);
+								// combine it with affine mappings of the camera back-projection and projection
+								cv::Matx22f A = linearProjections[i] * D * (1 / measuredPoint[3]);
+								// calculate the inverse of the covariance matrix
+								cv::Matx22f icovar = (A * A.t()).inv() * (1 / variance);
+								batch.ivarA[at] = icovar(0,0);
+								batch.ivarB[at] = icovar(0,1);
+								batch.ivarD[at] = icovar(1,1);
+								#else
+								batch.ivarA[at] = 1/variance;
+								#endif
+
+								if (measuredPoint[2] / measuredPoint[3] < -1) {
+									//printf(" One camera sees this point with depth %g, skipping\n", measuredPoint[2] / measuredPoint[3]);
+									okay = false;
+									break;
+								}
+								batch.measuredX[at] = measuredPoint[0] / measuredPoint[3];
+								batch.measuredY[at] = measuredPoint[1] / measuredPoint[3];
+								cv::Vec4f base = projections[i] * cv::Vec4f(x, y, 0, 1);
+								batch.baseX[at] = base[0];
+								batch.baseY[at] = base[1];
+								batch.baseW[at] = base[3];
+							}}
+							if (okay) {
+								batch.x[lane] = x;
+								batch.y[lane] = y;
+								batch.z[lane] = depthRow[col];
+								batch.row[lane] = (row - roi.y) / stride;
+								batch.col[lane] = (col - roi.x) / stride;
+								if (++batch.size == triangulationBatchSize)
+									count = triangulateBatch(batch, projections, mainCameraInv, block, pixelIndices, count);
+							}
+						}
 					}
-					measuredPoint.rowRange(0,2).copyTo(measuredPoints.col(i));
-				}}
-				if (okay) {
-					DensityPoint result = triangulatePixel(x, y, measuredPoints, invVariances, mainCameraInv, cameras, depthRow[col]);
-					points.row(pixelId).colRange(0,4) = result.point.t();
-					// save the density of the point to be processed later in this function
-					points.at<float>(pixelId, 4) = result.density;
-					pixelIndices.at<int32_t>(row, col) = pixelId;
-					pixelId ++;
 				}
+				count = triangulateBatch(batch, projections, mainCameraInv, block, pixelIndices, count);
+				// release unnecessary matrix rows
+				block.resize(count);
+				blocks[tile] = block;
 			}
 		}
-	}
-	// release unnecessary matrix rows
-	points.resize(pixelId);
-	
-	// == BEGIN Estimate normals from neighborhood in the main frame ==
+	protected:
+		const MatList &flows;
+		const Mat &depth, &gradient;
+		const cv::Rect &roi;
+		int stride;
+		const std::vector<cv::Matx44f> &projections;
+		const std::vector<cv::Matx23f> &linearProjections;
+		const cv::Matx44f &mainCameraInv;
+		std::vector<Mat> &blocks;
+		Mat &pixelIndices;
+};
 
-	// half size of the square neighborhood to be considered
-	const int radius = 10;
-	// centers of all side cameras, used to obtain correct normal orientation
-	std::vector<Mat> cameraCenters(1, extractCameraCenter(mainCamera));
-	for (MatList::const_iterator camera=cameras.begin(); camera!=cameras.end(); camera++) {
-		cameraCenters.push_back(extractCameraCenter(*camera));
+// Copies the block of each tile to its place in points, and makes pixelIndices of the tile relative to the start of points
+class MergeTiles: public cv::ParallelLoopBody {
+	public:
+		MergeTiles(const std::vector<Mat> &blocks, const std::vector<int> &offsets, Mat &points, Mat &pixelIndices):
+			blocks(blocks), offsets(offsets), points(points), pixelIndices(pixelIndices) {};
+		void operator()(const cv::Range &range) const
+		{
+			for (int tile=range.start; tile < range.end; tile++) {
+				if (blocks[tile].empty())
+					continue;
+				blocks[tile].copyTo(points.rowRange(offsets[tile], offsets[tile] + blocks[tile].rows));
+				int begin = tile*triangulationTileRows, end = IMIN(begin + triangulationTileRows, pixelIndices.rows);
+				for (int row=begin; row < end; row++) {
+					int32_t *idRow = pixelIndices.ptr<int32_t>(row);
+					for (int col=0; col < pixelIndices.cols; col++) {
+						if (idRow[col] >= 0)
+							idRow[col] += offsets[tile];
+					}
+				}
+			}
+		}
+	protected:
+		const std::vector<Mat> &blocks;
+		const std::vector<int> &offsets;
+		Mat &points, &pixelIndices;
+};
+
+// == Normal estimation ==
+// The normal of each point is the direction of least variance of the points triangulated in a square window around its pixel;
+// all the sums needed for the covariance of a window are read from a summed-area table in constant time
+
+// channels of the summed-area table: count of the points, sums of x, y, z, and sums of xx, xy, xz, yy, yz, zz
+const int normalSums = 10;
+
+// Eigenvector of a symmetric 3x3 matrix [a00 a01 a02; a01 a11 a12; a02 a12 a22] belonging to its smallest eigenvalue
+// the eigenvalues are found in closed form, the eigenvector as the longest cross product of two rows of (A - lambda*I)
+cv::Vec3d smallestEigenvector(double a00, double a01, double a02, double a11, double a12, double a22)
+{
+	double offDiagonal = a01*a01 + a02*a02 + a12*a12;
+	if (offDiagonal == 0) {
+		// diagonal matrix, the eigenvectors are the axes
+		int axis = (a00 <= a11 && a00 <= a22) ? 0 : (a11 <= a22) ? 1 : 2;
+		cv::Vec3d result(0, 0, 0);
+		result[axis] = 1;
+		return result;
 	}
-	for (int i=0; i<cameraCenters.size(); i++) {
-		cameraCenters[i] = cameraCenters[i].rowRange(0, 3).t() / cameraCenters[i].at<float>(3);
+	double q = (a00 + a11 + a22) / 3;
+	double p = sqrt(((a00-q)*(a00-q) + (a11-q)*(a11-q) + (a22-q)*(a22-q) + 2*offDiagonal) / 6);
+	// B = (A - q*I) / p has eigenvalues 2*cos(phi + 2*k*pi/3)
+	double b00 = (a00-q)/p, b11 = (a11-q)/p, b22 = (a22-q)/p, b01 = a01/p, b02 = a02/p, b12 = a12/p;
+	double r = (b00*(b11*b22 - b12*b12) - b01*(b01*b22 - b12*b02) + b02*(b01*b12 - b11*b02)) / 2;
+	double phi = acos(IMIN(IMAX(r, -1.), 1.)) / 3;
+	double lambda = q + 2*p*cos(phi + 2*M_PI/3);
+
+	cv::Vec3d rows[3] = {cv::Vec3d(a00-lambda, a01, a02), cv::Vec3d(a01, a11-lambda, a12), cv::Vec3d(a02, a12, a22-lambda)};
+	cv::Vec3d candidates[3] = {rows[0].cross(rows[1]), rows[0].cross(rows[2]), rows[1].cross(rows[2])};
+	int best = 0;
+	for (int i=1; i<3; i++) {
+		if (candidates[i].dot(candidates[i]) > candidates[best].dot(candidates[best]))
+			best = i;
 	}
-	
-	Mat neighborhood(0, 3, CV_32FC1);
-	cv::PCA shape;
-	neighborhood.reserve(4*(radius+1)*(radius+1));
-	
-	// estimate the normal for each triangulated point
-	for (int row=0; row<height; row++) {
-		for (int col=0; col<width; col++) {
-			// get index of the point triangulated from this position (or skip if no such point)
-			int pixelId = pixelIndices.at<int32_t>(row, col);
-			if (pixelId < 0)
+	double length = sqrt(candidates[best].dot(candidates[best]));
+	return (length > 0) ? candidates[best] * (1/length) : cv::Vec3d(0, 0, 1);
+}
+
+// Center of projection of a camera, in Cartesian coordinates
+cv::Vec3d cameraCenter(const Mat camera)
+{
+	Mat center;
+	extractCameraCenter(camera).convertTo(center, CV_64F);
+	return cv::Vec3d(center.at<double>(0), center.at<double>(1), center.at<double>(2)) * (1 / center.at<double>(3));
+}
+
+// triangulated rows whose normals are estimated by one task; its summed-area table covers normalRadius more rows on both sides
+const int normalBandRows = 64;
+
+// Summed-area table of the points triangulated in grid rows top, ..., bottom-1: table(row+1, col+1) holds the sums over
+// grid rows top...top+row and grid columns 0...col; the points are taken relative to their centroid (returned in origin),
+// so that the sums of squares do not lose precision
+Mat normalTable(const Mat &pixelIndices, const Mat &points, int top, int bottom, cv::Vec3d &origin)
+{
+	origin = cv::Vec3d(0, 0, 0);
+	int count = 0;
+	for (int row=top; row < bottom; row++) {
+		const int32_t *idRow = pixelIndices.ptr<int32_t>(row);
+		for (int col=0; col < pixelIndices.cols; col++) {
+			if (idRow[col] < 0)
 				continue;
-			
-			// the density value as calculated previously
-			float pdf = points.at<float>(pixelId, 4);
-			// wild guess: normalize pdf per side camera -> nth root
-			if (cameras.size() > 1)
-				pdf = pow(pdf, 1.0/cameras.size());
-			
-			// add all neighbor points to the neighborhood matrix
-			for (int ny=row-radius; ny<=row+radius; ny++) {
-				if (ny < 0 || ny >= height)
-					continue;
-				int32_t *idRow = pixelIndices.ptr<int32_t>(ny);
-				for (int nx=col-radius; nx<=col+radius; nx++) {
-					// check that a point corresponding to this neighbor exists
-					if (nx < 0 || nx >= width || idRow[nx] < 0)
-						continue;
-					Mat point = points.row(idRow[nx]).colRange(0,3) / points.at<float>(idRow[nx], 3);
-					neighborhood.push_back(point);
-				}
+			const float *point = points.ptr<float>(idRow[col]);
+			origin += cv::Vec3d(point[0]/point[3], point[1]/point[3], point[2]/point[3]);
+			count++;
+		}
+	}
+	if (count > 0)
+		origin *= 1. / count;
+
+	Mat table = Mat::zeros(bottom - top + 1, pixelIndices.cols + 1, CV_64FC(normalSums));
+	for (int row=top; row < bottom; row++) {
+		const int32_t *idRow = pixelIndices.ptr<int32_t>(row);
+		// running sums along the row, added to the sums of the rows above
+		const double *above = table.ptr<double>(row - top) + normalSums;
+		double *sums = table.ptr<double>(row - top + 1) + normalSums;
+		double running[normalSums] = {0};
+		for (int col=0; col < pixelIndices.cols; col++, above += normalSums, sums += normalSums) {
+			int pixelId = idRow[col];
+			if (pixelId >= 0) {
+				const float *point = points.ptr<float>(pixelId);
+				double x = point[0]/point[3] - origin[0], y = point[1]/point[3] - origin[1], z = point[2]/point[3] - origin[2];
+				running[0] += 1;
+				running[1] += x; running[2] += y; running[3] += z;
+				running[4] += x*x; running[5] += x*y; running[6] += x*z;
+				running[7] += y*y; running[8] += y*z; running[9] += z*z;
 			}
-			
-			// calculate the normal based on the neighborhood
-			Mat normal;
-			if (neighborhood.rows >= 3) {
-				// apply PCA to the neighbors: slow but easy
-				shape(neighborhood, cv::noArray(), CV_PCA_DATA_AS_ROW);
-				// normal is the smallest eigenvector, up to flipping (and scale, in this implementation)
-				normal = shape.eigenvectors.row(2);
-				float dot;
-				for (int i=0; i<cameraCenters.size(); i++) {
-					// weighting of cameras inversely to distance
-					dot += 1/normal.dot(cameraCenters[i] - points.row(pixelId).colRange(0,3) / points.at<float>(pixelId, 3));
-				}
-				
-				// if the majority of the cameras views the normal from the back, flip it
-				if (dot < 0)
-					normal = -normal;
-				
-				// clear the neighborhood
-				neighborhood.resize(0);
-			} else {
-				// if not enough neighbors available, try to guess a normal from the camera centers
-				normal = Mat::zeros(1, 3, CV_32FC1);
-				for (int i=0; i<cameraCenters.size(); i++) {
-					Mat vec = cameraCenters[i] - points.row(pixelId).colRange(0,3);
-					normal += vec / vec.dot(vec);
+			for (int k=0; k < normalSums; k++)
+				sums[k] = above[k] + running[k];
+		}
+	}
+	return table;
+}
+
+// Estimates the normal of each triangulated point from its neighborhood in the main frame, in bands of rows
+// each band gets a summed-area table of its own, so that the memory needed does not grow with the size of the frame
+// pixelIndices: index of the point triangulated at each position of the grid of triangulated pixels, or -1
+class EstimateNormals: public cv::ParallelLoopBody {
+	public:
+		EstimateNormals(const Mat &pixelIndices, const std::vector<cv::Vec3d> &cameraCenters, int cameraCount, Mat &points):
+			pixelIndices(pixelIndices), cameraCenters(cameraCenters), cameraCount(cameraCount), points(points) {};
+		void operator()(const cv::Range &range) const
+		{
+			const int radius = normalRadius, rows = pixelIndices.rows, cols = pixelIndices.cols;
+			for (int band=range.start; band < range.end; band++) {
+				int begin = band * normalBandRows, end = IMIN(begin + normalBandRows, rows);
+				// rows of the table, clipped to the grid
+				int tableTop = IMAX(begin - radius, 0), tableBottom = IMIN(end + radius, rows);
+				cv::Vec3d origin;
+				Mat table = normalTable(pixelIndices, points, tableTop, tableBottom, origin);
+				for (int row=begin; row < end; row++) {
+					// window rows in the table
+					int top = IMAX(row - radius, 0) - tableTop, bottom = IMIN(row + radius + 1, rows) - tableTop;
+					const double *topRow = table.ptr<double>(top), *bottomRow = table.ptr<double>(bottom);
+					const int32_t *idRow = pixelIndices.ptr<int32_t>(row);
+					for (int col=0; col < cols; col++) {
+						// get index of the point triangulated from this position (or skip if no such point)
+						int pixelId = idRow[col];
+						if (pixelId < 0)
+							continue;
+						float *out = points.ptr<float>(pixelId);
+						cv::Vec3d point(out[0]/out[3], out[1]/out[3], out[2]/out[3]);
+
+						// the density value as calculated previously
+						float pdf = out[4];
+						// wild guess: normalize pdf per side camera -> nth root
+						if (cameraCount > 1)
+							pdf = pow(pdf, 1.0/cameraCount);
+
+						// sums over all neighbor points
+						int left = IMAX(col - radius, 0) * normalSums, right = IMIN(col + radius + 1, cols) * normalSums;
+						double sums[normalSums];
+						for (int k=0; k < normalSums; k++)
+							sums[k] = bottomRow[right+k] - bottomRow[left+k] - topRow[right+k] + topRow[left+k];
+
+						// calculate the normal based on the neighborhood
+						cv::Vec3d normal(0, 0, 0);
+						double count = sums[0];
+						if (count >= 3) {
+							// normal is the eigenvector of the covariance matrix with the smallest eigenvalue, up to flipping
+							double mx = sums[1]/count, my = sums[2]/count, mz = sums[3]/count;
+							normal = smallestEigenvector(sums[4]/count - mx*mx, sums[5]/count - mx*my, sums[6]/count - mx*mz,
+							                             sums[7]/count - my*my, sums[8]/count - my*mz, sums[9]/count - mz*mz);
+							double dot = 0;
+							for (int i=0; i<cameraCenters.size(); i++) {
+								// weighting of cameras inversely to distance
+								dot += 1/normal.dot(cameraCenters[i] - point);
+							}
+							// if the majority of the cameras views the normal from the back, flip it
+							if (dot < 0)
+								normal = -normal;
+						} else {
+							// if not enough neighbors available, try to guess a normal from the camera centers
+							for (int i=0; i<cameraCenters.size(); i++) {
+								cv::Vec3d vec = cameraCenters[i] - point;
+								normal += vec * (1 / vec.dot(vec));
+							}
+						}
+
+						// normalize the normal and scale it according to the triangulation probability
+						normal *= pdf / sqrt(normal.dot(normal));
+						for (int j=0; j<3; j++)
+							out[4+j] = normal[j];
+					}
 				}
 			}
-			
-			// normalize the normal and scale it according to the triangulation probability
-			points.row(pixelId).colRange(4,7) = normal * pdf / cv::norm(normal);
 		}
+	protected:
+		const Mat &pixelIndices;
+		const std::vector<cv::Vec3d> &cameraCenters;
+		int cameraCount;
+		Mat &points;
+};
+
+// Triangulate all available pixels of the main camera's frame
+// flows: packed flows with variance, as returned by FlowContext::calculate
+// roi: part of the depth map the flows were calculated on; the flows have its size and are indexed relative to its corner
+// stride: only every stride-th pixel in both directions is triangulated
+Mat triangulatePixels(const MatList flows, const Mat mainCamera, const MatList cameras, const Mat depth, cv::Rect roi, int stride)
+{
+	int width = depth.cols, height = depth.rows;
+	if (roi.area() == 0)
+		roi = cv::Rect(0, 0, width, height);
+	
+	cv::Matx44f mainCameraInv = Mat(mainCamera.inv());
+	Mat gradient;
+	#ifdef USE_COVAR_MATRICES
+	gradient = imageGradient(depth);
+	#endif
+	// index of the point triangulated at each position of the grid of triangulated pixels
+	Mat pixelIndices = -Mat::ones((roi.height + stride - 1) / stride, (roi.width + stride - 1) / stride, CV_32SC1);
+
+	// projection of each side camera from main camera's space, and its linear part (for the covariances)
+	std::vector<cv::Matx44f> projections;
+	std::vector<cv::Matx23f> linearProjections;
+	for (MatList::const_iterator camera=cameras.begin(); camera!=cameras.end(); camera++) {
+		cv::Matx44f side = *camera;
+		projections.push_back(side * mainCameraInv);
+		linearProjections.push_back(side.get_minor<2,3>(0,0) * mainCameraInv.get_minor<3,3>(0,0));
+	}
+
+	// triangulate each tile of rows on its own, then put the points of all tiles together
+	int tiles = (roi.height + triangulationTileRows*stride - 1) / (triangulationTileRows*stride);
+	std::vector<Mat> blocks(tiles);
+	cv::parallel_for_(cv::Range(0, tiles), TriangulateTiles(flows, depth, gradient, roi, stride, projections, linearProjections, mainCameraInv, blocks, pixelIndices));
+	std::vector<int> offsets(tiles + 1, 0);
+	for (int tile=0; tile < tiles; tile++)
+		offsets[tile+1] = offsets[tile] + blocks[tile].rows;
+	// point \in P^3, normal (scaled by probability) \in R^3
+	Mat points(offsets[tiles], 4+3, CV_32FC1);
+	cv::parallel_for_(cv::Range(0, tiles), MergeTiles(blocks, offsets, points, pixelIndices));
+	
+	// == BEGIN Estimate normals from neighborhood in the main frame ==
+
+	// centers of all side cameras, used to obtain correct normal orientation
+	std::vector<cv::Vec3d> cameraCenters(1, cameraCenter(mainCamera));
+	for (MatList::const_iterator camera=cameras.begin(); camera!=cameras.end(); camera++) {
+		cameraCenters.push_back(cameraCenter(*camera));
 	}
 
+	// estimate the normal for each triangulated point
+	int bands = (pixelIndices.rows + normalBandRows - 1) / normalBandRows;
+	cv::parallel_for_(cv::Range(0, bands), EstimateNormals(pixelIndices, cameraCenters, cameras.size(), points));
+
 	return points;
 }
 
 // estimate the variance given a reference image and an image remapped by the optical flow
 Mat compare(const Mat prev, const Mat next)
 {
-	std::vector<Mat> diffPyramid;
-	int size = (prev.rows < prev.cols) ? prev.rows : prev.cols;
-	Mat a, b;
-	prev.convertTo(a, CV_32FC1);
-	next.convertTo(b, CV_32FC1);
-	
-	// go up the pyramid and calculate the L1 difference between the downscaled versions of the images
+	return compare(comparePyramid(prev), next);
+}
+
+// downscaled versions of the image as used by compare(), up to the topmost level
+std::vector<Mat> comparePyramid(const Mat image)
+{
+	std::vector<Mat> pyramid;
+	int size = (image.rows < image.cols) ? image.rows : image.cols;
+	Mat level;
+	image.convertTo(level, CV_32FC1);
 	while (1) {
-		Mat diff;
-		cv::absdiff(a, b, diff);
-		diffPyramid.push_back(diff);
+		pyramid.push_back(level);
 		if (size <= 2)
 			// repeat until the topmost level of the pyramid
 			break;
-		cv::pyrDown(a, a);
-		cv::pyrDown(b, b);
+		Mat smaller;
+		cv::pyrDown(level, smaller);
+		level = smaller;
 		size /= 2;
 	}
+	return pyramid;
+}
+
+// same as compare(prev, next), with the pyramid of prev already calculated
+Mat compare(const std::vector<Mat> &prevPyramid, const Mat next)
+{
+	std::vector<Mat> diffPyramid(prevPyramid.size());
+	Mat b;
+	next.convertTo(b, CV_32FC1);
+	
+	// go up the pyramid and calculate the L1 difference between the downscaled versions of the images
+	for (int i=0; i < prevPyramid.size(); i++) {
+		if (i > 0)
+			cv::pyrDown(b, b);
+		cv::absdiff(prevPyramid[i], b, diffPyramid[i]);
+	}
 	
 	// go down and sum up all the differences to each pixel
 	for (int i=diffPyramid.size()-2; i>=0; i--) {
@@ -360,6 +714,96 @@ Mat compare(const Mat prev, const Mat next)
 	return diffPyramid[0];
 }
 
+#ifdef HALF_F16C
+// Same as packHalf and unpackHalf, eight values at a time; return the number of values processed
+__attribute__((target("f16c")))
+int packHalfF16C(const float *src, uint16_t *dst, int count)
+{
+	int i = 0;
+	for (; i + 8 <= count; i += 8)
+		_mm_storeu_si128((__m128i *)(dst + i), _mm256_cvtps_ph(_mm256_loadu_ps(src + i), 0));
+	return i;
+}
+__attribute__((target("f16c")))
+int unpackHalfF16C(const uint16_t *src, float *dst, int count)
+{
+	int i = 0;
+	for (; i + 8 <= count; i += 8)
+		_mm256_storeu_ps(dst + i, _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)(src + i))));
+	return i;
+}
+static const bool hasF16C = __builtin_cpu_supports("f16c");
+#endif
+
+// convert count floats to half precision
+void packHalf(const float *src, uint16_t *dst, int count)
+{
+	int i = 0;
+	#ifdef HALF_F16C
+	if (hasF16C)
+		i = packHalfF16C(src, dst, count);
+	#endif
+	for (; i < count; i++)
+		dst[i] = floatToHalf(src[i]);
+}
+
+// convert count half precision values to floats
+void unpackHalf(const uint16_t *src, float *dst, int count)
+{
+	int i = 0;
+	#ifdef HALF_F16C
+	if (hasF16C)
+		i = unpackHalfF16C(src, dst, count);
+	#endif
+	for (; i < count; i++)
+		dst[i] = halfToFloat(src[i]);
+}
+
+// convert a packed flow back to CV_32FC4 of (flow x, flow y, variance, 0), e.g. to be saved or passed to flowRemap
+Mat unpackFlow(const Mat packed)
+{
+	assert(packed.type() == CV_16UC4);
+	Mat result(packed.rows, packed.cols, CV_32FC4);
+	for (int i=0; i<packed.rows; i++)
+		unpackHalf(packed.ptr<uint16_t>(i), result.ptr<float>(i), 4*packed.cols);
+	return result;
+}
+
+// bounding box of the pixels that are not background, grown by margin on each side and clipped to the image; empty if there are none
+cv::Rect foregroundBounds(const Mat depth, int margin)
+{
+	int top = depth.rows, bottom = -1, left = depth.cols, right = -1;
+	for (int i=0; i<depth.rows; i++) {
+		const float *row = depth.ptr<float>(i);
+		int first = 0, last = depth.cols-1;
+		while (first <= last && row[first] == backgroundDepth)
+			first ++;
+		if (first > last)
+			continue;
+		while (row[last] == backgroundDepth)
+			last --;
+		top = IMIN(top, i);
+		bottom = i;
+		left = IMIN(left, first);
+		right = IMAX(right, last);
+	}
+	if (bottom < 0)
+		return cv::Rect();
+	top = IMAX(top - margin, 0);
+	left = IMAX(left - margin, 0);
+	bottom = IMIN(bottom + margin, depth.rows-1);
+	right = IMIN(right + margin, depth.cols-1);
+	return cv::Rect(left, top, right-left+1, bottom-top+1);
+}
+
+// place an image calculated on the given part of a larger image back to its position, zero elsewhere
+Mat uncrop(const Mat image, const cv::Rect roi, const cv::Size size)
+{
+	Mat result = Mat::zeros(size, image.type());
+	image.copyTo(result(roi));
+	return result;
+}
+
 // mask out areas where the result of raycasting was undefined
 // return image.first_channel if (image.second_channel > 0 and depth < backgroundDepth) else background
 // set depth = backgroundDepth in the masked out areas
@@ -579,3 +1023,83 @@ void saveMesh(const Mesh mesh, const char *fileName)
 	}
 	os.close();
 }
+
+#ifdef TEST_BUILD
+// Main function for testing of the batched triangulation
+// refines random batches by newtonScalar and by each vector variant the CPU supports, and checks that they agree
+// returns nonzero if any depth differs by more than the tolerance (relative to 1 + |z|)
+int main(int argc, char ** argv)
+{
+	const int batchCount = (argc > 1) ? atoi(argv[1]) : 100, cameraCount = 3;
+	const float tolerance = 1e-4;
+	cv::RNG rng(12345);
+	double maxAVX2 = 0, maxAVX512 = 0;
+	for (int n=0; n < batchCount; n++) {
+		// side cameras displaced from the main one, projecting z = 1 to a finite point
+		std::vector<cv::Matx44f> projections;
+		for (int i=0; i < cameraCount; i++) {
+			projections.push_back(cv::Matx44f(1, 0, rng.uniform(0.1f, 0.5f), rng.uniform(-0.3f, 0.3f),
+			                                  0, 1, rng.uniform(0.1f, 0.5f), rng.uniform(-0.3f, 0.3f),
+			                                  0, 0, 1, 0,
+			                                  0, 0, rng.uniform(-0.2f, 0.2f), 1));
+		}
+		TriangulationBatch batch(projections);
+		batch.size = triangulationBatchSize;
+		for (int p=0; p < batch.size; p++) {
+			float x = rng.uniform(-1.f, 1.f), y = rng.uniform(-1.f, 1.f), depth = rng.uniform(-0.8f, 0.8f);
+			batch.x[p] = x;
+			batch.y[p] = y;
+			batch.z[p] = depth + rng.uniform(-0.1f, 0.1f);
+			for (int i=0; i < cameraCount; i++) {
+				int at = i*triangulationBatchSize + p;
+				cv::Vec4f base = projections[i] * cv::Vec4f(x, y, 0, 1), measured = projections[i] * cv::Vec4f(x, y, depth, 1);
+				batch.baseX[at] = base[0];
+				batch.baseY[at] = base[1];
+				batch.baseW[at] = base[3];
+				batch.measuredX[at] = measured[0] / measured[3] + rng.gaussian(0.01);
+				batch.measuredY[at] = measured[1] / measured[3] + rng.gaussian(0.01);
+				batch.ivarA[at] = rng.uniform(0.5f, 2.f);
+				batch.ivarD[at] = rng.uniform(0.5f, 2.f);
+				batch.ivarB[at] = rng.uniform(-0.4f, 0.4f) * sqrt(batch.ivarA[at] * batch.ivarD[at]);
+			}
+		}
+
+		TriangulationBatch scalar = batch;
+		newtonScalar(scalar, 0, scalar.size);
+		#ifdef TRIANGULATE_SIMD
+		if (hasAVX2) {
+			TriangulationBatch vector = batch;
+			for (int p=0; p + 8 <= vector.size; p += 8)
+				newtonAVX2(vector, p);
+			for (int p=0; p < batch.size; p++)
+				maxAVX2 = IMAX(maxAVX2, fabs(vector.z[p] - scalar.z[p]) / (1 + fabs(scalar.z[p])));
+		}
+		if (hasAVX512) {
+			TriangulationBatch vector = batch;
+			for (int p=0; p + 16 <= vector.size; p += 16)
+				newtonAVX512(vector, p);
+			for (int p=0; p < batch.size; p++)
+				maxAVX512 = IMAX(maxAVX512, fabs(vector.z[p] - scalar.z[p]) / (1 + fabs(scalar.z[p])));
+		}
+		#endif
+	}
+
+	bool okay = true;
+	#ifdef TRIANGULATE_SIMD
+	if (hasAVX2) {
+		printf("AVX2: largest difference from newtonScalar %g\n", maxAVX2);
+		okay = okay && maxAVX2 <= tolerance;
+	} else
+		printf("AVX2: not supported by this CPU\n");
+	if (hasAVX512) {
+		printf("AVX-512: largest difference from newtonScalar %g\n", maxAVX512);
+		okay = okay && maxAVX512 <= tolerance;
+	} else
+		printf("AVX-512: not supported by this CPU\n");
+	#else
+	printf("No vector variants compiled in\n");
+	#endif
+	printf("%s (tolerance %g)\n", okay ? "OK" : "FAILED", tolerance);
+	return okay ? 0 : 1;
+}
+#endif